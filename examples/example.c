@@ -33,6 +33,8 @@ main(int argc, char *argv[])
     tc_param_def_init(&param_def[1], ds[1], N);
 
     struct tc_opts opts = tc_default_opts;
+    opts.burnin = 10;
+    opts.thin = 2;
     int res = tc_clustering(ds, N, param_def, K, cb, NULL, &opts);
     if (res != 0) {
         err(1, "Clustering failed");
@@ -43,23 +45,21 @@ main(int argc, char *argv[])
 bool
 cb(const struct tc_tree *tree, double l, const void **ds, size_t N, void *data)
 {
-    size_t S = 0;
-    struct tc_segment *segments = tc_segments(tree, ds, N, &S);
+    /* Segments of the tree carry their population, volume and box. */
+    const struct tc_node *segment = NULL;
     printf("l = %lf\n", l);
-    for (size_t s = 0; s < S; s++) {
+    for (size_t s = 0; s < tree->segments.n; s++) {
+        segment = tree->segments.nodes[s];
         printf("%zu: NX = %zu, V = %lf, ((%lf, %lf),(%lf, %lf))\n",
             s,
-            segments[s].NX,
-            segments[s].V,
-            segments[s].ranges[0].min,
-            segments[s].ranges[0].max,
-            segments[s].ranges[1].min,
-            segments[s].ranges[1].max
+            segment->NX,
+            segment->V,
+            segment->box[0],
+            segment->box[1],
+            segment->box[2],
+            segment->box[3]
         );
     }
     printf("\n");
-    tc_free_segments(segments, S);
-    free(segments);
-    segments = NULL;
     return true;
 }
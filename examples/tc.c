@@ -1,109 +1,520 @@
+/*
+ * tc.c
+ *
+ * Command-line interface to tree clustering.
+ *
+ * Text input is mapped into memory and split into chunks at line
+ * boundaries, which are parsed on separate threads into columns of their
+ * own. Columns of chunks are then concatenated in the order of chunks.
+ *
+ */
+
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <err.h>
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <tc.h>
 
 #define debug(...) fprintf(stderr, __VA_ARGS__)
 
+/* Initial capacity of columns of a chunk. */
+#define CHUNK_CAPACITY 1024
+
+/* Maximum length of a number passed to strtod. */
+#define FIELD_MAX 128
+
 const char *program_name = NULL;
 
+struct chunk {
+    const char *start; /* Start of text of the chunk. */
+    const char *end; /* End of text of the chunk. */
+    size_t K; /* Number of fields of a line. */
+    char delimiter; /* Field delimiter. */
+    const bool *nominal; /* True for nominal fields. */
+    union tc_value **columns; /* Values of every field. */
+    size_t N; /* Number of values in columns. */
+    size_t capacity; /* Capacity of columns. */
+    size_t nlines; /* Number of lines parsed. */
+    const char *error; /* Error message, or NULL. */
+};
+
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
 void
 usage(void)
 {
-    fprintf(stderr, "Usage: %s FILE\n\n", program_name);
+    fprintf(stderr, "Usage: %s [OPTIONS] FILE\n\n", program_name);
     fprintf(stderr, "Try `%s --help` for help.\n", program_name);
 }
 
 void
 help(void)
 {
-    fprintf(stderr, "Usage: %s FILE\n\n", program_name);
+    fprintf(stderr, "Usage: %s [OPTIONS] FILE\n\n", program_name);
     fprintf(stderr, "Perform segmentation of data using tree clustering.\n\n");
     fprintf(stderr, "Optional arguments:\n");
-    fprintf(stderr, "  -h,--help        print this help information and exit\n");
+    fprintf(stderr, "  -h,--help               print this help information and exit\n");
+    fprintf(stderr, "  -d,--delimiter CHAR     field delimiter (default: tab)\n");
+    fprintf(stderr, "  -f,--fragment-size SIZE fragment size of metric fields (default: 0)\n");
+    fprintf(stderr, "  -j,--threads N          number of threads (default: number of processors)\n");
+    fprintf(stderr, "  -n,--nsamples N         number of samples (default: 10)\n");
+    fprintf(stderr, "  -c,--nominal LIST       comma-separated list of nominal fields (from 1)\n");
+    fprintf(stderr, "  -q,--quantize           quantize metric fields into fragment indices\n");
+    fprintf(stderr, "  -s,--seed SEED          seed of random number generator\n");
+    fprintf(stderr, "  -w,--write OUTPUT       write dataset to binary file OUTPUT and exit\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "FILE is a file containing tab-separated data.\n");
+    fprintf(stderr, "FILE is a file containing delimiter-separated data, or a binary\n");
+    fprintf(stderr, "dataset file. Lines starting with # are ignored. The first line is\n");
+    fprintf(stderr, "a header if it contains a field which is not a number. Empty fields,\n");
+    fprintf(stderr, "NA and NaN of metric fields are missing values. Nominal fields must\n");
+    fprintf(stderr, "be integers. Segments of the last sample are printed in JSON.\n");
 }
 
-void **
-read_dataset(const char *filename, size_t *N, size_t *K)
+/*
+ * Parse special number `p` to `end` (missing value or infinity).
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+parse_special(const char *p, const char *end, double *x)
 {
-    size_t n = 0;
-    char *line = NULL;
-    char *s = NULL;
-    const char *p = NULL;
-    int off = 0;
-    FILE *fp = NULL;
-    void **ds = NULL;
-    bool first = true;
-    size_t N_ = 1024;
+    size_t n = end - p;
+    bool neg = false;
+    if (n == 0 ||
+        (n == 2 && strncasecmp(p, "na", 2) == 0) ||
+        (n == 3 && strncasecmp(p, "nan", 3) == 0)) {
+        *x = NAN;
+        return 0;
+    }
+    if (*p == '-' || *p == '+') {
+        neg = *p == '-';
+        p++;
+        n--;
+    }
+    if ((n == 3 && strncasecmp(p, "inf", 3) == 0) ||
+        (n == 8 && strncasecmp(p, "infinity", 8) == 0)) {
+        *x = neg ? -INFINITY : INFINITY;
+        return 0;
+    }
+    return -1;
+}
 
-    fp = fopen(filename, "r");
-    if (fp == NULL)
-        err(1, "%s", filename);
+/*
+ * Parse decimal number `p` to `end`. Numbers whose mantissa and exponent
+ * are exactly representable are converted by a single multiplication
+ * or division, other numbers by strtod. Returns 0 on success, -1 on failure.
+ */
+static int
+parse_double(const char *p, const char *end, double *x)
+{
+    const char *s = p;
+    uint64_t m = 0;
+    int e = 0, ee = 0, ndigits = 0, nused = 0;
+    bool neg = false, eneg = false, exact = true;
+    char buf[FIELD_MAX];
+    char *q = NULL;
 
-    while (1) {
-        line = NULL;
-        errno = 0;
-        n = fscanf(fp, "%m[^\n]\n", &line);
-        if (n != 1) {
-            if (errno != 0)
-                err(1, "%s", filename);
-            break;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++, ndigits++) {
+        if (m == 0 && *p == '0') continue;
+        if (nused < 19) {
+            m = m*10 + (*p - '0');
+            nused++;
+        } else {
+            e++;
+            if (*p != '0') exact = false;
         }
-        if (line[0] == '#') goto cleanup;
-
-        if (first) {
-            /* Count the number of fields. */
-            p = line;
-            while ((n = sscanf(p, "%ms%n", &s, &off)) == 1) {
-                *K++;
-                free(s);
-                s = NULL;
-                p += off;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, ndigits++) {
+            if (m == 0 && *p == '0') {
+                e--;
+                continue;
             }
-            ds = calloc(*K, sizeof(void *));
-            if (ds == NULL)
-                err(1, "");
-            for (k = 0; k < *K; k++) {
-                ds[k] = calloc(N_, sizeof)
-
+            if (nused < 19) {
+                m = m*10 + (*p - '0');
+                nused++;
+                e--;
+            } else if (*p != '0') {
+                exact = false;
             }
-            first = false;
         }
-        p = line;
-        while ((n = sscanf(p, "%ms%n", &s, &off)) == 1) {
-            printf("FIELD=%s\n", s);
-            free(s);
-            s = NULL;
-            p += off;
+    }
+    if (ndigits == 0)
+        return parse_special(s, end, x);
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            eneg = *p == '-';
+            p++;
+        }
+        if (p == end) return -1;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            if (ee < 100000) ee = ee*10 + (*p - '0');
+        e += eneg ? -ee : ee;
+    }
+    if (p != end) return -1;
+
+    if (exact && m < ((uint64_t) 1 << 53) && e >= -22 && e <= 22) {
+        *x = e < 0 ? m/POW10[-e] : m*POW10[e];
+        if (neg) *x = -*x;
+        return 0;
+    }
+    if (end - s >= FIELD_MAX) return -1;
+    memcpy(buf, s, end - s);
+    buf[end - s] = '\0';
+    *x = strtod(buf, &q);
+    return *q == '\0' ? 0 : -1;
+}
+
+/*
+ * Parse integer `p` to `end`. Returns 0 on success, -1 on failure.
+ */
+static int
+parse_int64(const char *p, const char *end, int64_t *v)
+{
+    uint64_t u = 0;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    if (p == end) return -1;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9' || u > (UINT64_MAX - 9)/10) return -1;
+        u = u*10 + (*p - '0');
+    }
+    if (u > (uint64_t) INT64_MAX + neg) return -1;
+    *v = neg ? (int64_t) (0 - u) : (int64_t) u;
+    return 0;
+}
+
+/*
+ * Return the end of line starting at `p`, or `end`.
+ */
+static const char *
+line_end(const char *p, const char *end)
+{
+    const char *q = memchr(p, '\n', end - p);
+    return q != NULL ? q : end;
+}
+
+/*
+ * Return the number of fields of line `p` to `eol`.
+ */
+static size_t
+count_fields(const char *p, const char *eol, char delimiter)
+{
+    size_t K = 1;
+    for (; p < eol; p++)
+        if (*p == delimiter) K++;
+    return K;
+}
+
+/*
+ * Ensure that columns of `chunk` have room for one more line by doubling
+ * their capacity. Returns 0 on success, -1 on failure.
+ */
+static int
+chunk_reserve(struct chunk *chunk)
+{
+    size_t k = 0, capacity = 0;
+    union tc_value *column = NULL;
+    if (chunk->N < chunk->capacity)
+        return 0;
+    capacity = chunk->capacity > 0 ? 2*chunk->capacity : CHUNK_CAPACITY;
+    for (k = 0; k < chunk->K; k++) {
+        column = realloc(chunk->columns[k], capacity*sizeof(union tc_value));
+        if (column == NULL) return -1;
+        chunk->columns[k] = column;
+    }
+    chunk->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Parse line `p` to `eol` of `chunk` into its columns. Returns 0 on success,
+ * -1 on failure, with an error message in `chunk->error`.
+ */
+static int
+parse_line(struct chunk *chunk, const char *p, const char *eol)
+{
+    size_t k = 0;
+    const char *q = NULL;
+    union tc_value *value = NULL;
+
+    if (chunk_reserve(chunk) != 0) {
+        chunk->error = strerror(ENOMEM);
+        return -1;
+    }
+    for (k = 0; k < chunk->K; k++) {
+        q = memchr(p, chunk->delimiter, eol - p);
+        if (q == NULL) q = eol;
+        if (q == eol && k + 1 < chunk->K) {
+            chunk->error = "Too few fields";
+            return -1;
+        }
+        value = &chunk->columns[k][chunk->N];
+        if (chunk->nominal[k] ?
+            parse_int64(p, q, &value->int64) != 0 :
+            parse_double(p, q, &value->float64) != 0) {
+            chunk->error = chunk->nominal[k] ?
+                "Invalid integer" :
+                "Invalid number";
+            return -1;
         }
+        p = q + 1;
+    }
+    if (q != eol) {
+        chunk->error = "Too many fields";
+        return -1;
+    }
+    chunk->N++;
+    return 0;
+}
+
+/*
+ * Parse lines of chunk `arg`. Runs in a thread of its own.
+ */
+static void *
+parse_chunk(void *arg)
+{
+    struct chunk *chunk = arg;
+    const char *p = chunk->start, *eol = NULL, *next = NULL;
+    for (; p < chunk->end; p = next) {
+        eol = line_end(p, chunk->end);
+        next = eol + 1;
+        chunk->nlines++;
+        if (eol > p && eol[-1] == '\r') eol--;
+        if (eol > p && *p != '#' && parse_line(chunk, p, eol) != 0)
+            return NULL;
+    }
+    return NULL;
+}
 
+/*
+ * Return true if line `p` to `eol` is a header, i.e. it contains a field
+ * which is not a number.
+ */
+static bool
+is_header(const char *p, const char *eol, char delimiter)
+{
+    const char *q = NULL;
+    double x = 0;
+    for (;;) {
+        q = memchr(p, delimiter, eol - p);
+        if (q == NULL) q = eol;
+        if (parse_double(p, q, &x) != 0)
+            return true;
+        if (q == eol)
+            return false;
+        p = q + 1;
+    }
+}
 
-        printf("\n");
+/*
+ * Read delimiter-separated text file `filename` with `nthreads` threads.
+ * Fields listed in `nominal_list` (numbered from 1) are read as integers
+ * of nominal parameters, other fields as metric parameters. Returns
+ * the dataset of `N` elements with `K` parameters, whose types are stored
+ * in `param_def`, or exits on failure.
+ */
+void **
+read_dataset(
+    const char *filename,
+    char delimiter,
+    const char *nominal_list,
+    size_t nthreads,
+    size_t *N,
+    size_t *K,
+    struct tc_param_def **param_def
+) {
+    int fd = -1;
+    struct stat st;
+    const char *text = NULL, *p = NULL, *q = NULL, *end = NULL, *eol = NULL;
+    size_t i = 0, k = 0, n = 0, lineno = 0, size = 0;
+    bool *nominal = NULL;
+    struct chunk *chunks = NULL;
+    pthread_t *threads = NULL;
+    void **ds = NULL;
+    char *list = NULL, *tok = NULL, *save = NULL;
+    long field = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0)
+        err(1, "%s", filename);
+    size = st.st_size;
+    if (size > 0) {
+        text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED)
+            err(1, "%s", filename);
+        madvise((void *) text, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    end = text + size;
+
+    /* Determine the number of fields from the first line of data. */
+    for (p = text; p < end; p = eol + 1) {
+        eol = line_end(p, end);
+        lineno++;
+        if (eol > p && *p != '#') break;
+    }
+    if (p >= end)
+        errx(1, "%s: No data", filename);
+    if (eol[-1] == '\r') eol--;
+    *K = count_fields(p, eol, delimiter);
+    if (is_header(p, eol, delimiter))
+        p = line_end(p, end) + 1;
+    else
+        lineno--;
+
+    nominal = calloc(*K, sizeof(bool));
+    if (nominal == NULL)
+        err(1, "read_dataset");
+    if (nominal_list != NULL) {
+        list = strdup(nominal_list);
+        if (list == NULL)
+            err(1, "read_dataset");
+        for (tok = strtok_r(list, ",", &save); tok != NULL;
+             tok = strtok_r(NULL, ",", &save)) {
+            field = strtol(tok, NULL, 10);
+            if (field < 1 || (size_t) field > *K)
+                errx(1, "%s: Invalid nominal field", tok);
+            nominal[field - 1] = true;
+        }
+        free(list);
+    }
+
+    /* Split the rest into chunks at line boundaries. */
+    chunks = calloc(nthreads, sizeof(struct chunk));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (chunks == NULL || threads == NULL)
+        err(1, "read_dataset");
+    for (i = 0; i < nthreads; i++) {
+        chunks[i].start = i == 0 ? p : chunks[i-1].end;
+        q = p + (end - p)*(i + 1)/nthreads;
+        if (q < chunks[i].start)
+            q = chunks[i].start;
+        if (i + 1 == nthreads)
+            q = end;
+        else if (q < end && (q = line_end(q, end)) < end)
+            q++;
+        chunks[i].end = q;
+        chunks[i].K = *K;
+        chunks[i].delimiter = delimiter;
+        chunks[i].nominal = nominal;
+        chunks[i].columns = calloc(*K, sizeof(union tc_value *));
+        if (chunks[i].columns == NULL)
+            err(1, "read_dataset");
+        if (pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]) != 0)
+            errx(1, "Cannot create thread");
+    }
+    *N = 0;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (chunks[i].error != NULL) {
+            errx(1, "%s:%zu: %s",
+                filename,
+                lineno + chunks[i].nlines,
+                chunks[i].error
+            );
+        }
+        lineno += chunks[i].nlines;
+        *N += chunks[i].N;
+    }
 
-    cleanup:
-        if (line != NULL) {
-            free(line);
-            line = NULL;
+    /* Concatenate columns of chunks. */
+    ds = calloc(*K, sizeof(void *));
+    if (ds == NULL)
+        err(1, "read_dataset");
+    for (k = 0; k < *K; k++) {
+        ds[k] = calloc(*N > 0 ? *N : 1, sizeof(union tc_value));
+        if (ds[k] == NULL)
+            err(1, "read_dataset");
+        n = 0;
+        for (i = 0; i < nthreads; i++) {
+            memcpy(
+                (union tc_value *) ds[k] + n,
+                chunks[i].columns[k],
+                chunks[i].N*sizeof(union tc_value)
+            );
+            n += chunks[i].N;
+            free(chunks[i].columns[k]);
         }
     }
+    *param_def = calloc(*K, sizeof(struct tc_param_def));
+    if (*param_def == NULL)
+        err(1, "read_dataset");
+    for (k = 0; k < *K; k++) {
+        (*param_def)[k].type = nominal[k] ? TC_NOMINAL : TC_METRIC;
+        (*param_def)[k].size = nominal[k] ? TC_INT64 : TC_FLOAT64;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        free(chunks[i].columns);
+    free(chunks);
+    free(threads);
+    free(nominal);
+    if (size > 0)
+        munmap((void *) text, size);
+    return ds;
+}
+
+static size_t nsamples = 0;
 
-    return data;
+bool
+cb(const struct tc_tree *tree, double l, const void **ds, size_t N, void *data)
+{
+    size_t *count = data;
+    if (++*count == nsamples)
+        tc_dump_segments_json(tree, ds, N);
+    return true;
 }
 
 int
 main(int argc, char *argv[])
 {
     const char *filename = NULL;
+    const char *output = NULL;
+    const char *nominal_list = NULL;
+    char delimiter = '\t';
+    double fragment_size = 0;
+    long nthreads = 0;
+    size_t k = 0, N = 0, K = 0, count = 0;
+    void **ds = NULL;
+    struct tc_param_def *param_def = NULL;
+    struct tc_dataset *dataset = NULL;
+    struct tc_opts opts = tc_default_opts;
     int c = 0;
     int option_index = 0;
     static struct option long_options[] = {
-        {"help", no_argument, 0, 0},
+        {"help", no_argument, 0, 'h'},
+        {"delimiter", required_argument, 0, 'd'},
+        {"fragment-size", required_argument, 0, 'f'},
+        {"threads", required_argument, 0, 'j'},
+        {"nsamples", required_argument, 0, 'n'},
+        {"nominal", required_argument, 0, 'c'},
+        {"quantize", no_argument, 0, 'q'},
+        {"seed", required_argument, 0, 's'},
+        {"write", required_argument, 0, 'w'},
         {NULL, 0, NULL, 0}
     };
 
@@ -112,20 +523,46 @@ main(int argc, char *argv[])
     while ((c = getopt_long(
         argc,
         argv,
-        "h",
+        "hd:f:j:n:c:qs:w:",
         long_options,
         &option_index)
     ) != -1) {
         switch (c) {
-        case 0:
-            if (strcmp(long_options[option_index].name, "help") == 0) {
-                help();
-                exit(0);
-            }
         case 'h':
             help();
             exit(0);
+        case 'd':
+            if (strcmp(optarg, "\\t") == 0)
+                delimiter = '\t';
+            else if (strlen(optarg) == 1)
+                delimiter = optarg[0];
+            else
+                errx(1, "%s: Invalid delimiter", optarg);
+            break;
+        case 'f':
+            fragment_size = strtod(optarg, NULL);
+            break;
+        case 'j':
+            nthreads = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts.nsamples = strtoul(optarg, NULL, 10);
             break;
+        case 'c':
+            nominal_list = optarg;
+            break;
+        case 'q':
+            opts.quantize = true;
+            break;
+        case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            output = optarg;
+            break;
+        default:
+            usage();
+            exit(1);
         }
     }
 
@@ -135,10 +572,67 @@ main(int argc, char *argv[])
     }
 
     filename = argv[optind];
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+    opts.nthreads = nthreads;
+    nsamples = opts.nsamples;
 
-    void **ds = NULL;
-    size_t N = 0;
-    size_t K = 0;
-    ds = read_dataset(filename, &N, &K);
+    dataset = tc_dataset_open(filename);
+    if (dataset != NULL) {
+        ds = (void **) dataset->ds;
+        N = dataset->N;
+        K = dataset->K;
+        param_def = dataset->param_def;
+    } else {
+        if (errno != EINVAL)
+            err(1, "%s", filename);
+        ds = read_dataset(
+            filename,
+            delimiter,
+            nominal_list,
+            nthreads,
+            &N,
+            &K,
+            &param_def
+        );
+        for (k = 0; k < K; k++) {
+            if (param_def[k].type == TC_METRIC)
+                param_def[k].fragment_size = fragment_size;
+            tc_param_def_init(&param_def[k], ds[k], N);
+        }
+    }
+
+    if (output != NULL) {
+        if (tc_dataset_write(
+            output,
+            (const void **) ds,
+            N,
+            param_def,
+            K
+        ) != 0)
+            err(1, "%s", output);
+    } else {
+        if (tc_clustering(
+            (const void **) ds,
+            N,
+            param_def,
+            K,
+            cb,
+            &count,
+            &opts
+        ) != 0)
+            err(1, "Clustering failed");
+    }
+
+    if (dataset != NULL) {
+        tc_dataset_close(dataset);
+    } else {
+        for (k = 0; k < K; k++)
+            free(ds[k]);
+        free(ds);
+        free(param_def);
+    }
     return 0;
 }
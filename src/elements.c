@@ -0,0 +1,880 @@
+/*
+ * elements.c
+ *
+ * Partitioning of elements by node.
+ *
+ * Elements of a tree are kept in a permutation such that elements of every
+ * node occupy a contiguous slice, and slices of child nodes follow each other
+ * in the order of children. Proposals then only need to visit elements
+ * of the affected segments.
+ *
+ * Elements of a segment whose parent splits a metric parameter are in
+ * addition sorted by the value of that parameter, with missing values
+ * at the end of the slice. Populations of segments on either side of a cut
+ * of the parent are then found by binary search. Elements of children
+ * of a nominal node are in no particular order.
+ *
+ * If elements are weighted, the tree also holds cumulative weights
+ * of the permutation, so that the weight of any slice is a difference
+ * of two entries. Functions which rearrange elements within a slice
+ * update cumulative weights of the slice, whose total does not change.
+ * Populations passed to the likelihood are weights, while numbers
+ * of elements returned for rearranging are counts of elements. Elements
+ * with a missing value have weight 1.
+ *
+ * Values of quantized metric parameters are read as fragment indices,
+ * and cuts are converted to fragment indices before comparison.
+ * If the tree has a summed-area table, populations of proposed segments
+ * are looked up in the table instead.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "tree.h"
+#include "elements.h"
+#include "quantize.h"
+#include "sat.h"
+#include "tc.h"
+
+#define SWAP(x, y) do { size_t t_ = (x); (x) = (y); (y) = t_; } while (0)
+
+/*
+ * Values of a metric parameter of elements.
+ */
+struct column {
+    const void *data; /* Values or fragment indices. */
+    unsigned width; /* Bytes per fragment index, or 0 for values. */
+};
+
+/*
+ * Return the column of metric parameter `param` of tree `tree`, which are
+ * fragment indices if the parameter is quantized, or values of dataset `ds`.
+ */
+static struct column
+get_column(const struct tc_tree *tree, const void *ds[], size_t param)
+{
+    struct column col;
+    if (tree->quantized != NULL && tree->quantized->width[param] != 0) {
+        col.data = tree->quantized->data[param];
+        col.width = tree->quantized->width[param];
+    } else {
+        col.data = ds[param];
+        col.width = 0;
+    }
+    return col;
+}
+
+/*
+ * Return the value of element `n` in column `col`, or NaN if missing.
+ * Fragment indices are integers, which compare exactly.
+ */
+static inline double
+value(struct column col, size_t n)
+{
+    uint32_t j = 0;
+    switch (col.width) {
+    case 1:
+        j = ((const uint8_t *) col.data)[n];
+        return j != UINT8_MAX ? j : NAN;
+    case 2:
+        j = ((const uint16_t *) col.data)[n];
+        return j != UINT16_MAX ? j : NAN;
+    case 4:
+        j = ((const uint32_t *) col.data)[n];
+        return j != UINT32_MAX ? j : NAN;
+    default:
+        return ((const double *) col.data)[n];
+    }
+}
+
+/*
+ * Return cut `cut` of parameter `param` in the units of column `col`.
+ */
+static double
+column_cut(
+    const struct tc_tree *tree,
+    struct column col,
+    size_t param,
+    double cut
+) {
+    if (col.width == 0)
+        return cut;
+    return fragment_index(&tree->param_def[param], cut);
+}
+
+/*
+ * Returns true if elements of segment `node` are sorted by parameter `param`.
+ */
+static bool
+is_sorted(const struct tc_node *node, size_t param)
+{
+    return node->parent != NULL &&
+        node->parent->param == param &&
+        node->tree->param_def[param].type == TC_METRIC;
+}
+
+/*
+ * Reverse the order of `n` elements.
+ */
+static void
+reverse(size_t *elements, size_t n)
+{
+    size_t i = 0;
+    for (i = 0; i < n/2; i++)
+        SWAP(elements[i], elements[n - i - 1]);
+}
+
+/*
+ * Return the weight of element `n` of tree `tree`.
+ */
+static size_t
+weight(const struct tc_tree *tree, size_t n)
+{
+    return tree->weights != NULL ? tree->weights[n] : 1;
+}
+
+/*
+ * Return the total weight of `n` elements of tree `tree` starting
+ * at offset `off` of the permutation.
+ */
+static size_t
+slice_weight(const struct tc_tree *tree, size_t off, size_t n)
+{
+    if (tree->cumw == NULL) return n;
+    return tree->cumw[off + n] - tree->cumw[off];
+}
+
+/*
+ * Update cumulative weights of `n` elements of tree `tree` starting
+ * at offset `off` after they were rearranged.
+ */
+static void
+update_weights(const struct tc_tree *tree, size_t off, size_t n)
+{
+    size_t i = 0;
+    if (tree->cumw == NULL) return;
+    for (i = off; i < off + n; i++)
+        tree->cumw[i+1] = tree->cumw[i] + tree->weights[tree->elements[i]];
+}
+
+/*
+ * Return the total weight of elements of node `node`.
+ */
+size_t
+node_weight(const struct tc_node *node)
+{
+    return slice_weight(node->tree, node->off, node->NX);
+}
+
+/*
+ * Rotate `n` elements so that the first `m` elements move to the end.
+ */
+static void
+rotate(size_t *elements, size_t n, size_t m)
+{
+    if (m == 0 || m == n) return;
+    reverse(elements, m);
+    reverse(elements + m, n - m);
+    reverse(elements, n);
+}
+
+/*
+ * Return the number of elements with a missing value at the end of `n`
+ * elements sorted by `col`.
+ */
+static size_t
+count_missing(const size_t *elements, size_t n, struct column col)
+{
+    size_t lo = 0, hi = n, mid = 0;
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (isnan(value(col, elements[mid])))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return n - lo;
+}
+
+/*
+ * Return the number of elements not greater than `cut` of `n` elements
+ * sorted by `col` with no missing values.
+ */
+static size_t
+count_below(const size_t *elements, size_t n, struct column col, double cut)
+{
+    size_t lo = 0, hi = n, mid = 0;
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (value(col, elements[mid]) <= cut)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Sort `n` elements with no missing values by `col`.
+ */
+static void
+quicksort(size_t *elements, size_t n, struct column col)
+{
+    size_t i = 0, j = 0, m = 0;
+    size_t t = 0;
+    double pivot = 0;
+
+    while (n > 16) {
+        /* Hoare partition around the middle element. */
+        pivot = value(col, elements[(n - 1)/2]);
+        i = 0;
+        j = n - 1;
+        for (;;) {
+            while (value(col, elements[i]) < pivot) i++;
+            while (value(col, elements[j]) > pivot) j--;
+            if (i >= j) break;
+            SWAP(elements[i], elements[j]);
+            i++;
+            j--;
+        }
+        m = j + 1;
+        /* Recurse into the smaller part, iterate over the larger one. */
+        if (m < n - m) {
+            quicksort(elements, m, col);
+            elements += m;
+            n -= m;
+        } else {
+            quicksort(elements + m, n - m, col);
+            n = m;
+        }
+    }
+    for (i = 1; i < n; i++) {
+        t = elements[i];
+        for (j = i; j > 0 && value(col, elements[j-1]) > value(col, t); j--)
+            elements[j] = elements[j-1];
+        elements[j] = t;
+    }
+}
+
+/*
+ * Sort `n` elements by `col`. Elements with a missing value are placed
+ * at the end.
+ */
+static void
+sort_elements(size_t *elements, size_t n, struct column col)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        if (isnan(value(col, elements[lo]))) {
+            hi--;
+            SWAP(elements[lo], elements[hi]);
+        } else {
+            lo++;
+        }
+    }
+    quicksort(elements, lo, col);
+}
+
+/*
+ * Partition `n` elements so that elements whose category in `data`
+ * (counted from `min`) is in bitset `set` come first. Returns the number
+ * of such elements.
+ */
+static size_t
+partition_categories(
+    size_t *elements,
+    size_t n,
+    const int64_t *data,
+    int64_t min,
+    const uint64_t *set
+) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        if (BITSET_GET(set, data[elements[lo]] - min)) {
+            lo++;
+        } else {
+            hi--;
+            SWAP(elements[lo], elements[hi]);
+        }
+    }
+    return lo;
+}
+
+/*
+ * Partition `n` elements so that elements with value `v` in `data` come
+ * first. Returns the number of such elements.
+ */
+static size_t
+partition_category(size_t *elements, size_t n, const int64_t *data, int64_t v)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        if (data[elements[lo]] == v) {
+            lo++;
+        } else {
+            hi--;
+            SWAP(elements[lo], elements[hi]);
+        }
+    }
+    return lo;
+}
+
+/*
+ * Initialize elements of tree `tree` with `N` elements, all of which
+ * belong to the root node. `weights` are weights of elements, or NULL
+ * if elements are not weighted. Returns 0 on success, -1 on failure.
+ */
+int
+init_elements(struct tc_tree *tree, size_t N, const uint32_t *weights)
+{
+    size_t n = 0;
+    tree->elements = calloc(N > 0 ? N : 1, sizeof(size_t));
+    if (tree->elements == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (n = 0; n < N; n++)
+        tree->elements[n] = n;
+    tree->N = N;
+    tree->weights = weights;
+    if (weights != NULL) {
+        tree->cumw = calloc(N + 1, sizeof(uint64_t));
+        if (tree->cumw == NULL) {
+            free_elements(tree);
+            errno = ENOMEM;
+            return -1;
+        }
+        update_weights(tree, 0, N);
+    }
+    tree->root->off = 0;
+    tree->root->NX = N;
+    return 0;
+}
+
+/*
+ * Free elements of tree `tree`.
+ */
+void
+free_elements(struct tc_tree *tree)
+{
+    if (tree->elements != NULL) free(tree->elements);
+    if (tree->cumw != NULL) free(tree->cumw);
+    tree->elements = NULL;
+    tree->cumw = NULL;
+    tree->weights = NULL;
+    tree->N = 0;
+}
+
+/*
+ * Count elements of segment `node` falling below cut `cut` in parameter
+ * `param` when the segment range (`min`, `max`) is split at the cut.
+ * Elements with a missing value are counted randomly (by `rng`) according
+ * to the width of the two parts. Returns the number of elements below the
+ * cut, which is passed to apply_split if the split is accepted, and stores
+ * their weight in `W`.
+ */
+size_t
+split_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    double min,
+    double max,
+    struct rng *rng,
+    size_t *W
+) {
+    size_t n = 0, NX = 0, nmissing = 0;
+    const size_t *elements = NULL;
+    struct column col;
+    double x = 0, c = 0;
+
+    if (tree->sat != NULL) {
+        /* Elements of trees with a summed-area table are not weighted. */
+        NX = sat_range_count(tree->sat, node, param, node->box[2*param], cut);
+        *W = NX;
+        return NX;
+    }
+
+    col = get_column(tree, ds, param);
+    c = column_cut(tree, col, param, cut);
+    elements = &tree->elements[node->off];
+    *W = 0;
+    if (is_sorted(node, param)) {
+        nmissing = count_missing(elements, node->NX, col);
+        NX = count_below(elements, node->NX - nmissing, col, c);
+        *W = slice_weight(tree, node->off, NX);
+    } else {
+        for (n = 0; n < node->NX; n++) {
+            x = value(col, elements[n]);
+            if (isnan(x)) {
+                nmissing++;
+            } else if (x <= c) {
+                NX++;
+                *W += weight(tree, elements[n]);
+            }
+        }
+    }
+    for (n = 0; n < nmissing; n++) {
+        if (frand(rng)*(max - min) < cut - min) {
+            NX++;
+            (*W)++;
+        }
+    }
+    return NX;
+}
+
+/*
+ * Returns true if split_elements or split_categories has to scan all
+ * elements of segment `node` to count a split in parameter `param`.
+ */
+bool
+split_scans(const struct tc_tree *tree, const struct tc_node *node, size_t param)
+{
+    return tree->sat == NULL && !is_sorted(node, param);
+}
+
+/*
+ * Count elements falling below cut `cut` in parameter `param` among `m`
+ * elements of segment `node` drawn at random (with replacement) by `rng`.
+ * Missing values are counted as in split_elements.
+ */
+size_t
+subsample_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    double min,
+    double max,
+    size_t m,
+    struct rng *rng
+) {
+    size_t n = 0, NX = 0;
+    const size_t *elements = NULL;
+    struct column col;
+    double x = 0, c = 0;
+
+    col = get_column(tree, ds, param);
+    c = column_cut(tree, col, param, cut);
+    elements = &tree->elements[node->off];
+    for (n = 0; n < m; n++) {
+        x = value(col, elements[sample(rng, node->NX, NULL)]);
+        if (isnan(x)) {
+            if (frand(rng)*(max - min) < cut - min)
+                NX++;
+        } else if (x <= c) {
+            NX++;
+        }
+    }
+    return NX;
+}
+
+/*
+ * Rearrange elements of segment `node` for an accepted split by cut `cut`
+ * in parameter `param`. `NX` is the number of elements below the cut
+ * as returned by split_elements. Afterwards, the first `NX` elements of
+ * the segment are below the cut, and both parts are sorted by `param`.
+ * Must be called before the tree is changed.
+ */
+void
+apply_split(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    size_t NX,
+    struct rng *rng
+) {
+    size_t n = 0, r = 0;
+    size_t nmissing = 0, nbelow = 0, nleft = 0;
+    size_t *elements = NULL;
+    struct column col;
+    bool sorted = is_sorted(node, param);
+
+    col = get_column(tree, ds, param);
+    elements = &tree->elements[node->off];
+    if (!sorted)
+        sort_elements(elements, node->NX, col);
+    nmissing = count_missing(elements, node->NX, col);
+    nbelow = count_below(
+        elements,
+        node->NX - nmissing,
+        col,
+        column_cut(tree, col, param, cut)
+    );
+
+    /* Choose elements with a missing value which go below the cut. */
+    nleft = NX - nbelow;
+    for (n = 0; n < nleft; n++) {
+        r = n + frand(rng)*(nmissing - n);
+        SWAP(
+            elements[node->NX - nmissing + n],
+            elements[node->NX - nmissing + r]
+        );
+    }
+    /* Move them in front of the elements above the cut. */
+    rotate(
+        elements + nbelow,
+        node->NX - nmissing - nbelow + nleft,
+        node->NX - nmissing - nbelow
+    );
+    if (sorted)
+        update_weights(tree, node->off + nbelow, node->NX - nbelow);
+    else
+        update_weights(tree, node->off, node->NX);
+}
+
+/*
+ * Count elements of segment `node` whose category in nominal parameter
+ * `param` is in bitset `set`. Returns the number of elements, which is passed
+ * to apply_split_categories if the split is accepted, and stores their
+ * weight in `W`.
+ */
+size_t
+split_categories(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    const uint64_t *set,
+    size_t *W
+) {
+    size_t n = 0, NX = 0;
+    const size_t *elements = NULL;
+    const int64_t *data = NULL;
+    int64_t min = 0;
+
+    data = ds[param];
+    min = tree->param_def[param].min.int64;
+    elements = &tree->elements[node->off];
+    if (tree->weights == NULL) {
+        for (n = 0; n < node->NX; n++)
+            NX += BITSET_GET(set, data[elements[n]] - min);
+        *W = NX;
+        return NX;
+    }
+    *W = 0;
+    for (n = 0; n < node->NX; n++) {
+        if (BITSET_GET(set, data[elements[n]] - min)) {
+            NX++;
+            *W += tree->weights[elements[n]];
+        }
+    }
+    return NX;
+}
+
+/*
+ * Count elements whose category of nominal parameter `param` is in bitset
+ * `set` among `m` elements of segment `node` drawn at random (with
+ * replacement) by `rng`.
+ */
+size_t
+subsample_categories(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    const uint64_t *set,
+    size_t m,
+    struct rng *rng
+) {
+    size_t n = 0, NX = 0;
+    const size_t *elements = NULL;
+    const int64_t *data = NULL;
+    int64_t min = 0;
+
+    data = ds[param];
+    min = tree->param_def[param].min.int64;
+    elements = &tree->elements[node->off];
+    for (n = 0; n < m; n++)
+        NX += BITSET_GET(set, data[elements[sample(rng, node->NX, NULL)]] - min);
+    return NX;
+}
+
+/*
+ * Rearrange elements of segment `node` for an accepted split of categories
+ * of nominal parameter `param`. Afterwards, elements whose category is
+ * in bitset `set` come first. Must be called before the tree is changed.
+ */
+void
+apply_split_categories(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    const uint64_t *set
+) {
+    partition_categories(
+        &tree->elements[node->off],
+        node->NX,
+        ds[param],
+        tree->param_def[param].min.int64,
+        set
+    );
+    update_weights(tree, node->off, node->NX);
+}
+
+/*
+ * Assign the first `NX` elements of `node` to segment `left` and the rest
+ * to segment `right`. `left` may be `node` itself.
+ */
+void
+divide_elements(
+    const struct tc_node *node,
+    struct tc_node *left,
+    struct tc_node *right,
+    size_t NX
+) {
+    size_t off = node->off, total = node->NX;
+    left->off = off;
+    left->NX = NX;
+    right->off = off + NX;
+    right->NX = total - NX;
+}
+
+/*
+ * Count elements of adjacent segments `node->children[i]` and
+ * `node->children[i+1]` if cut `i` of `node` moves to `cut`. Elements
+ * with a missing value stay in their segment. Returns the number of elements
+ * in the first segment after the move, which is passed to shift_elements
+ * if the move is accepted, and stores their weight in `W`.
+ */
+size_t
+move_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t i,
+    double cut,
+    size_t *W
+) {
+    size_t nmissing = 0, NX = 0;
+    const size_t *elements = NULL;
+    struct column col;
+    double c = 0;
+    const struct tc_node *left = NULL, *right = NULL;
+
+    left = node->children[i];
+    right = node->children[i+1];
+    if (tree->sat != NULL) {
+        NX = sat_range_count(
+            tree->sat,
+            left,
+            node->param,
+            left->box[2*node->param],
+            cut
+        );
+        *W = NX;
+        return NX;
+    }
+    col = get_column(tree, ds, node->param);
+    c = column_cut(tree, col, node->param, cut);
+    if (cut < node->cuts[i]) {
+        elements = &tree->elements[left->off];
+        nmissing = count_missing(elements, left->NX, col);
+        NX = count_below(elements, left->NX - nmissing, col, c);
+        *W = slice_weight(tree, left->off, NX) + nmissing;
+        return NX + nmissing;
+    } else {
+        elements = &tree->elements[right->off];
+        nmissing = count_missing(elements, right->NX, col);
+        NX = count_below(elements, right->NX - nmissing, col, c);
+        *W = node_weight(left) + slice_weight(tree, right->off, NX);
+        return left->NX + NX;
+    }
+}
+
+/*
+ * Move elements between adjacent segments `node->children[i]` and
+ * `node->children[i+1]` so that the first segment contains `NX` elements,
+ * as returned by move_elements.
+ */
+void
+shift_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    struct tc_node *node,
+    size_t i,
+    size_t NX
+) {
+    size_t nmissing = 0;
+    struct column col;
+    struct tc_node *left = NULL, *right = NULL;
+
+    left = node->children[i];
+    right = node->children[i+1];
+    col = get_column(tree, ds, node->param);
+    nmissing = count_missing(&tree->elements[left->off], left->NX, col);
+    if (NX < left->NX) {
+        /* Swap elements above the cut with missing values of the left. */
+        rotate(
+            &tree->elements[NX - nmissing + left->off],
+            left->NX - NX + nmissing,
+            left->NX - NX
+        );
+        update_weights(tree, NX - nmissing + left->off,
+            left->NX - NX + nmissing);
+    } else {
+        /* Swap missing values of the left with elements below the cut. */
+        rotate(
+            &tree->elements[left->off + left->NX - nmissing],
+            nmissing + NX - left->NX,
+            nmissing
+        );
+        update_weights(tree, left->off + left->NX - nmissing,
+            nmissing + NX - left->NX);
+    }
+    right->NX = left->NX + right->NX - NX;
+    right->off = left->off + NX;
+    left->NX = NX;
+}
+
+/*
+ * Count elements of adjacent segments `node->children[i]` and
+ * `node->children[i+1]` of nominal node `node` if category `c` (counted
+ * from the minimum of the parameter) is reassigned from one segment
+ * to the other. Returns the number of elements in the first segment after
+ * the move, which is passed to shift_category if the move is accepted,
+ * and stores their weight in `W`.
+ */
+size_t
+move_category(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t i,
+    size_t c,
+    size_t *W
+) {
+    size_t n = 0, m = 0, w = 0;
+    const size_t *elements = NULL;
+    const int64_t *data = NULL;
+    const struct tc_node *donor = NULL;
+    int64_t v = 0;
+
+    data = ds[node->param];
+    v = tree->param_def[node->param].min.int64 + c;
+    donor = node->children[node->categories[c]];
+    elements = &tree->elements[donor->off];
+    for (n = 0; n < donor->NX; n++) {
+        if (data[elements[n]] == v) {
+            m++;
+            w += weight(tree, elements[n]);
+        }
+    }
+    if (node->categories[c] == (int64_t) i) {
+        *W = node_weight(node->children[i]) - w;
+        return node->children[i]->NX - m;
+    }
+    *W = node_weight(node->children[i]) + w;
+    return node->children[i]->NX + m;
+}
+
+/*
+ * Move elements of category `c` between adjacent segments `node->children[i]`
+ * and `node->children[i+1]` of nominal node `node` for an accepted move.
+ * Must be called before the category is reassigned in `node`.
+ */
+void
+shift_category(
+    const struct tc_tree *tree,
+    const void *ds[],
+    struct tc_node *node,
+    size_t i,
+    size_t c
+) {
+    size_t m = 0;
+    size_t *elements = NULL;
+    const int64_t *data = NULL;
+    struct tc_node *left = NULL, *right = NULL;
+    int64_t v = 0;
+
+    left = node->children[i];
+    right = node->children[i+1];
+    data = ds[node->param];
+    v = tree->param_def[node->param].min.int64 + c;
+    if (node->categories[c] == (int64_t) i) {
+        /* Move elements of the category to the end of the left. */
+        elements = &tree->elements[left->off];
+        m = partition_category(elements, left->NX, data, v);
+        rotate(elements, left->NX, m);
+        update_weights(tree, left->off, left->NX);
+        left->NX -= m;
+        right->off -= m;
+        right->NX += m;
+    } else {
+        /* Move elements of the category to the start of the right. */
+        elements = &tree->elements[right->off];
+        m = partition_category(elements, right->NX, data, v);
+        update_weights(tree, right->off, right->NX);
+        left->NX += m;
+        right->off += m;
+        right->NX -= m;
+    }
+}
+
+/*
+ * Rearrange elements of adjacent segments `node->children[i]` and
+ * `node->children[i+1]` for an accepted merge. Must be called before
+ * the tree is changed.
+ */
+void
+apply_merge(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t i
+) {
+    size_t nmissing = 0, n = 0;
+    struct column col;
+    const struct tc_node *left = NULL, *right = NULL;
+
+    left = node->children[i];
+    right = node->children[i+1];
+    if (node->nchildren > 2) {
+        if (!IS_METRIC(node))
+            return; /* Children of a nominal node are not sorted. */
+        /* Merged segment remains sorted by the parameter of `node`. */
+        col = get_column(tree, ds, node->param);
+        nmissing = count_missing(&tree->elements[left->off], left->NX, col);
+        n = nmissing + right->NX - count_missing(
+            &tree->elements[right->off],
+            right->NX,
+            col
+        );
+        rotate(&tree->elements[left->off + left->NX - nmissing], n, nmissing);
+        update_weights(tree, left->off + left->NX - nmissing, n);
+    } else if (node->parent != NULL && is_sorted(node, node->parent->param)) {
+        /* Node becomes a segment sorted by the parameter of its parent. */
+        sort_elements(
+            &tree->elements[node->off],
+            node->NX,
+            get_column(tree, ds, node->parent->param)
+        );
+        update_weights(tree, node->off, node->NX);
+    }
+}
+
+/*
+ * Assign elements of adjacent segments `left` and `right` to `merged`,
+ * which may be `left` itself.
+ */
+void
+merge_elements(
+    const struct tc_node *left,
+    const struct tc_node *right,
+    struct tc_node *merged
+) {
+    merged->off = left->off;
+    merged->NX = left->NX + right->NX;
+}
@@ -0,0 +1,151 @@
+/*
+ * elements.h
+ *
+ * Partitioning of elements by node.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tc.h"
+
+struct rng;
+
+int init_elements(struct tc_tree *tree, size_t N, const uint32_t *weights);
+
+size_t node_weight(const struct tc_node *node);
+
+void free_elements(struct tc_tree *tree);
+
+size_t
+split_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    double min,
+    double max,
+    struct rng *rng,
+    size_t *W
+);
+
+bool
+split_scans(const struct tc_tree *tree, const struct tc_node *node, size_t param);
+
+size_t
+subsample_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    double min,
+    double max,
+    size_t m,
+    struct rng *rng
+);
+
+void
+apply_split(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    size_t NX,
+    struct rng *rng
+);
+
+size_t
+split_categories(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    const uint64_t *set,
+    size_t *W
+);
+
+size_t
+subsample_categories(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    const uint64_t *set,
+    size_t m,
+    struct rng *rng
+);
+
+void
+apply_split_categories(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t param,
+    const uint64_t *set
+);
+
+void
+divide_elements(
+    const struct tc_node *node,
+    struct tc_node *left,
+    struct tc_node *right,
+    size_t NX
+);
+
+size_t
+move_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t i,
+    double cut,
+    size_t *W
+);
+
+void
+shift_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    struct tc_node *node,
+    size_t i,
+    size_t NX
+);
+
+size_t
+move_category(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t i,
+    size_t c,
+    size_t *W
+);
+
+void
+shift_category(
+    const struct tc_tree *tree,
+    const void *ds[],
+    struct tc_node *node,
+    size_t i,
+    size_t c
+);
+
+void
+apply_merge(
+    const struct tc_tree *tree,
+    const void *ds[],
+    const struct tc_node *node,
+    size_t i
+);
+
+void
+merge_elements(
+    const struct tc_node *left,
+    const struct tc_node *right,
+    struct tc_node *merged
+);
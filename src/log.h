@@ -0,0 +1,70 @@
+/*
+ * log.h
+ *
+ * Recording of accepted proposals for the sample log.
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tc.h"
+
+/*
+ * Proposals accepted by a chain since its last logged sample.
+ */
+struct log_chain {
+    uint8_t *deltas; /* Encoded deltas. */
+    size_t size; /* Size of deltas in bytes. */
+    size_t capacity; /* Capacity of deltas in bytes. */
+    size_t ndeltas; /* Number of deltas. */
+    size_t nsince; /* Number of samples logged since the last snapshot. */
+    bool snapshot; /* The next sample needs a snapshot. */
+};
+
+bool
+log_matches(
+    const struct tc_log *log,
+    const struct tc_param_def param_def[],
+    size_t K
+);
+
+void log_chain_init(struct log_chain *lc);
+
+void log_chain_free(struct log_chain *lc);
+
+void log_chain_reset(struct log_chain *lc);
+
+int
+log_split(
+    struct log_chain *lc,
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    const int64_t *categories
+);
+
+int log_merge(struct log_chain *lc, const struct tc_node *node, size_t i);
+
+int
+log_move(
+    struct log_chain *lc,
+    const struct tc_node *node,
+    size_t i,
+    double cut,
+    size_t c
+);
+
+int
+log_sample(
+    struct tc_log *log,
+    struct log_chain *lc,
+    const struct tc_tree *tree,
+    double l
+);
+
+#endif /* LOG_H */
@@ -10,42 +10,132 @@
 #include <math.h>
 #include <assert.h>
 #include <strings.h>
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_randist.h>
 
 #include "misc.h"
 
-/* GNU Scientific Library RNG. */
-gsl_rng *rng = NULL;
+/*
+ * SplitMix64 step. Advances `x` and returns the next number.
+ */
+static uint64_t
+splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30))*UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27))*UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t
+rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
 
 /*
- * Log-Beta function (Stirling approx.).
+ * Seed random number generator `rng` by `seed`. The state is expanded
+ * from the seed by SplitMix64, so that any seed (incl. 0) gives a valid
+ * state.
  */
-double
-log_beta(double a, double b)
+void
+rng_seed(struct rng *rng, uint64_t seed)
+{
+    size_t i = 0;
+    for (i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&seed);
+}
+
+/*
+ * Generate a 64-bit pseudorandom number (xoshiro256**).
+ */
+uint64_t
+rng_next(struct rng *rng)
 {
-    return 0.5*log(2*M_PI) +
-        (a - 0.5)*log(a) +
-        (b - 0.5)*log(b) -
-        (a + b - 0.5)*log(a + b);
+    uint64_t *s = rng->s;
+    uint64_t r = rotl(s[1]*5, 7)*9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return r;
+}
+
+/*
+ * Advance random number generator `rng` by 2^128 numbers. Generators
+ * jumped from the same state by a different number of jumps give
+ * non-overlapping streams.
+ */
+void
+rng_jump(struct rng *rng)
+{
+    static const uint64_t JUMP[] = {
+        UINT64_C(0x180ec6d33cfd0aba),
+        UINT64_C(0xd5a61266f0c9392c),
+        UINT64_C(0xa9582618e03fc9aa),
+        UINT64_C(0x39abdc4529b1661c)
+    };
+    uint64_t s[4] = { 0, 0, 0, 0 };
+    size_t i = 0, j = 0, b = 0;
+
+    for (i = 0; i < 4; i++) {
+        for (b = 0; b < 64; b++) {
+            if (JUMP[i] & (UINT64_C(1) << b)) {
+                for (j = 0; j < 4; j++)
+                    s[j] ^= rng->s[j];
+            }
+            rng_next(rng);
+        }
+    }
+    for (j = 0; j < 4; j++)
+        rng->s[j] = s[j];
 }
 
 /*
  * Generate a floating-point pseudorandom number from the interval <0, 1).
  */
 double
-frand(void)
+frand(struct rng *rng)
 {
-    return rand()/(RAND_MAX + 1.0);
+    return (rng_next(rng) >> 11)*(1.0/(UINT64_C(1) << 53));
 }
 
 /*
  * Generate a floating-point pseudorandom number from the interval (0, 1).
  */
 double
-frand1(void)
+frand1(struct rng *rng)
 {
-    return (rand() + 1.)/(RAND_MAX + 2.);
+    return ((rng_next(rng) >> 12) + 0.5)*(1.0/(UINT64_C(1) << 52));
+}
+
+/*
+ * Generate a pseudorandom number from the normal distribution with mean 0
+ * and standard deviation `sd` (Marsaglia polar method).
+ */
+static double
+nrand(struct rng *rng, double sd)
+{
+    double u = 0, v = 0, r = 0;
+    do {
+        u = 2*frand(rng) - 1;
+        v = 2*frand(rng) - 1;
+        r = u*u + v*v;
+    } while (r >= 1 || r == 0);
+    return sd*u*sqrt(-2*log(r)/r);
+}
+
+/*
+ * Generate a floating-point number from the interval <0, 1) determined
+ * by hashing `n` and `i` (SplitMix64 finalizer). The same arguments
+ * always give the same number.
+ */
+double
+hrand(uint64_t n, uint64_t i)
+{
+    uint64_t x = n*UINT64_C(0x9e3779b97f4a7c15) + i;
+    return (splitmix64(&x) >> 11)*(1.0/(UINT64_C(1) << 53));
 }
 
 /*
@@ -54,7 +144,7 @@ frand1(void)
  * than 0.
  */
 size_t
-sample(size_t n, const double p[])
+sample(struct rng *rng, size_t n, const double p[])
 {
     double sum = 0;
     size_t i = 0;
@@ -66,7 +156,7 @@ sample(size_t n, const double p[])
             sum += p[i];
     }
 
-    double f = 0, r = frand();
+    double f = 0, r = frand(rng);
     if (p == NULL) return r*n;
     for (i = 0; i < n; i++) {
         f += p[i]/sum;
@@ -75,28 +165,6 @@ sample(size_t n, const double p[])
     assert(0);
 }
 
-/*
- * Initialize the GNU Scientific Library.
- */
-void
-init_gsl(void)
-{
-    const gsl_rng_type *T;
-    gsl_rng_env_setup();
-    T = gsl_rng_default;
-    rng = gsl_rng_alloc(T);
-}
-
-/*
- * Deinitialize the GNU Scientific Library.
- */
-void
-deinit_gsl(void)
-{
-   gsl_rng_free(rng);
-}
-
-
 /*
  * Generate a random number from the truncated normal distribution defined
  * by mean `mean`, standard deviation `sd`, and bounds `a`, `b`.
@@ -108,55 +176,30 @@ deinit_gsl(void)
  * TODO: Should be replaced by a better implementation.
  */
 double
-rtnorm(double mean, double sd, double a, double b)
+rtnorm(struct rng *rng, double mean, double sd, double a, double b)
 {
     double x = 0;
-    x = mean + gsl_ran_gaussian(rng, sd);
+    x = mean + nrand(rng, sd);
     while (!(x > a && x < b))
-        x = mean + gsl_ran_gaussian(rng, sd);
+        x = mean + nrand(rng, sd);
     return x;
 }
 
 /*
- * Insert `element` into `array`. `n` is the length of array, `i`
- * is the insert position, and `size` is the size of array elements in bytes.
- * Returns a newly-allocated array with the element inserted,
- * or NULL on failure. It is the responsibility of the callee to free the array.
+ * Return z such that a standard normal variable exceeds z with
+ * probability `p` (0 < p < 1), found by bisection.
  */
-void *
-array_insert(
-    const void *array,
-    size_t n,
-    const void *element,
-    size_t i,
-    size_t size
-) {
-    void *new_array = NULL;
-    void *p = NULL;
-    new_array = calloc(n + 1, size);
-    if (new_array == NULL) return NULL;
-    p = new_array;
-    bcopy(array, p, size*i);
-    p += size*i;
-    bcopy(element, p, size);
-    p += size;
-    bcopy(array + size*i, p, size*(n - i));
-    return new_array;
-}
-
-void *
-array_remove(const void *array, size_t n, size_t i, size_t size)
+double
+normal_quantile_upper(double p)
 {
-    void *new_array = NULL;
-    void *p = NULL;
-    assert(n > 0);
-    assert(i >= 0);
-    assert(i < n);
-    new_array = calloc(n - 1, size);
-    if (new_array == NULL) return NULL;
-    p = new_array;
-    bcopy(array, p, size*i);
-    p += size*i;
-    bcopy(array + size*(i+1), p, size*(n - i - 1));
-    return new_array;
+    double a = -40, b = 40, z = 0;
+    int i = 0;
+    for (i = 0; i < 100; i++) {
+        z = (a + b)/2;
+        if (0.5*erfc(z/sqrt(2)) > p)
+            a = z;
+        else
+            b = z;
+    }
+    return z;
 }
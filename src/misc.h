@@ -6,6 +6,7 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef DEBUG
@@ -17,26 +18,25 @@
 #define MAX(x, y) ((x)>=(y)?(x):(y))
 #define MIN(x, y) ((x)<=(y)?(x):(y))
 
-double log_beta(double a, double b);
+/* Random number generator state (xoshiro256**). */
+struct rng {
+    uint64_t s[4];
+};
 
-double frand(void);
+void rng_seed(struct rng *rng, uint64_t seed);
 
-double frand1(void);
+uint64_t rng_next(struct rng *rng);
 
-size_t sample(size_t n, const double p[]);
+void rng_jump(struct rng *rng);
 
-void init_gsl(void);
+double frand(struct rng *rng);
 
-void deinit_gsl(void);
+double frand1(struct rng *rng);
 
-double rtnorm(double mean, double sd, double a, double b);
+double hrand(uint64_t n, uint64_t i);
 
-void *array_insert(
-    const void *array,
-    size_t n,
-    const void *element,
-    size_t i,
-    size_t size
-);
+size_t sample(struct rng *rng, size_t n, const double p[]);
 
-void *array_remove(const void *array, size_t n, size_t i, size_t size);
+double rtnorm(struct rng *rng, double mean, double sd, double a, double b);
+
+double normal_quantile_upper(double p);
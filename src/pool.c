@@ -0,0 +1,189 @@
+/*
+ * pool.c
+ *
+ * Thread pool.
+ *
+ * The pool runs batches of numbered tasks. Tasks of a batch are taken
+ * by worker threads and by the thread calling pool_run one at a time,
+ * and pool_run returns when all of them are done. Batches of threads
+ * calling pool_run at the same time run one after another.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct pool {
+    size_t nthreads; /* Number of threads incl. the calling thread. */
+    pthread_t *threads; /* Worker threads. */
+    pthread_mutex_t busy; /* Held by the thread running a batch. */
+    pthread_mutex_t mutex;
+    pthread_cond_t start; /* Signalled when a batch starts. */
+    pthread_cond_t done; /* Signalled when a batch is done. */
+    unsigned long batch; /* Batch number. */
+    pool_task *task; /* Task function of the batch. */
+    void *arg; /* Argument of the task function. */
+    size_t ntasks; /* Number of tasks of the batch. */
+    size_t next; /* Next task to be taken. */
+    size_t running; /* Number of tasks being run. */
+    bool quit; /* Workers should exit. */
+};
+
+/*
+ * Run tasks of the current batch until none is left. Called with the pool
+ * mutex locked.
+ */
+static void
+run_tasks(struct pool *pool)
+{
+    size_t i = 0;
+    pool_task *task = pool->task;
+    void *arg = pool->arg;
+    while (pool->next < pool->ntasks) {
+        i = pool->next++;
+        pool->running++;
+        pthread_mutex_unlock(&pool->mutex);
+        task(arg, i);
+        pthread_mutex_lock(&pool->mutex);
+        pool->running--;
+    }
+    if (pool->running == 0)
+        pthread_cond_broadcast(&pool->done);
+}
+
+static void *
+worker(void *arg)
+{
+    struct pool *pool = arg;
+    unsigned long batch = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->quit && pool->batch == batch)
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        if (pool->quit) break;
+        batch = pool->batch;
+        run_tasks(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/*
+ * Return the number of online processors, or 1 if unknown.
+ */
+size_t
+pool_default_nthreads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Create a new pool of `nthreads` threads, including the thread calling
+ * pool_run. If `nthreads` is 0, the number of online processors is used.
+ * Returns NULL on failure.
+ */
+struct pool *
+pool_new(size_t nthreads)
+{
+    size_t i = 0;
+    struct pool *pool = NULL;
+
+    if (nthreads == 0)
+        nthreads = pool_default_nthreads();
+    pool = calloc(1, sizeof(struct pool));
+    if (pool == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&pool->busy, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nthreads = 1;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0) {
+            pool_free(pool);
+            errno = EAGAIN;
+            return NULL;
+        }
+        pool->nthreads++;
+    }
+    return pool;
+}
+
+/*
+ * Return the number of threads of `pool`, including the calling thread.
+ */
+size_t
+pool_nthreads(const struct pool *pool)
+{
+    return pool->nthreads;
+}
+
+/*
+ * Run tasks 0, ..., `ntasks` - 1 by calling `task` with argument `arg`
+ * and the task number, and wait until all of them are done.
+ */
+void
+pool_run(struct pool *pool, pool_task *task, void *arg, size_t ntasks)
+{
+    size_t i = 0;
+
+    if (pool->nthreads == 1) {
+        for (i = 0; i < ntasks; i++)
+            task(arg, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->busy);
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->arg = arg;
+    pool->ntasks = ntasks;
+    pool->next = 0;
+    pool->running = 0;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->start);
+    run_tasks(pool);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&pool->busy);
+}
+
+/*
+ * Stop threads of `pool` and free it.
+ */
+void
+pool_free(struct pool *pool)
+{
+    size_t i = 0;
+
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->busy);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,26 @@
+/*
+ * pool.h
+ *
+ * Thread pool.
+ *
+ */
+
+#include <stddef.h>
+
+struct pool;
+
+/*
+ * Task function. Called with the argument passed to pool_run and the task
+ * number `i`.
+ */
+typedef void pool_task(void *arg, size_t i);
+
+size_t pool_default_nthreads(void);
+
+struct pool *pool_new(size_t nthreads);
+
+size_t pool_nthreads(const struct pool *pool);
+
+void pool_run(struct pool *pool, pool_task *task, void *arg, size_t ntasks);
+
+void pool_free(struct pool *pool);
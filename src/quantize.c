@@ -0,0 +1,170 @@
+/*
+ * quantize.c
+ *
+ * Quantization of metric parameters into fragment indices.
+ *
+ * Cuts of a metric parameter with a non-zero fragment size are placed
+ * on the grid fragment_cut(pd, j), j = 1, 2, .... A value is replaced
+ * by the index of the first cut not below it, so that the value is below
+ * cut j exactly if its index is not greater than j. Indices are stored
+ * in 1, 2 or 4 bytes, whichever suffices for the range of the parameter,
+ * with the largest value of the type marking a missing value.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "quantize.h"
+#include "tc.h"
+
+/*
+ * Return cut `j` of metric parameter `pd`, i.e. the minimum of the parameter
+ * plus `j` fragments.
+ */
+double
+fragment_cut(const struct tc_param_def *pd, int64_t j)
+{
+    return pd->min.float64 + j*pd->fragment_size;
+}
+
+/*
+ * Return the number of cut `cut` of metric parameter `pd`, which needs
+ * to be within rounding error of a cut on the grid of fragments.
+ */
+int64_t
+fragment_index(const struct tc_param_def *pd, double cut)
+{
+    return llround((cut - pd->min.float64)/pd->fragment_size);
+}
+
+/*
+ * Return the fragment index of value `x` of metric parameter `pd`,
+ * i.e. the least j >= 0 such that x <= fragment_cut(pd, j).
+ */
+int64_t
+value_index(const struct tc_param_def *pd, double x)
+{
+    double j = ceil((x - pd->min.float64)/pd->fragment_size);
+    int64_t i = j > 0 ? (int64_t) j : 0;
+    /* Correct rounding of the division. */
+    while (i > 0 && x <= fragment_cut(pd, i - 1))
+        i--;
+    while (x > fragment_cut(pd, i))
+        i++;
+    return i;
+}
+
+/*
+ * Quantize metric parameter `pd` of `N` values `x` into `q`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+quantize_column(
+    const struct tc_param_def *pd,
+    const double *x,
+    size_t N,
+    struct tc_quantized *q,
+    size_t k
+) {
+    size_t n = 0;
+    int64_t j = 0, max = 0;
+    unsigned width = 0;
+    uint32_t missing = 0;
+    void *data = NULL;
+
+    for (n = 0; n < N; n++) {
+        if (isnan(x[n]))
+            continue;
+        if (!((x[n] - pd->min.float64)/pd->fragment_size < UINT32_MAX - 1))
+            return 0; /* Too many fragments or infinite value. */
+        max = MAX(max, value_index(pd, x[n]));
+    }
+    if (max < UINT8_MAX) {
+        width = 1;
+        missing = UINT8_MAX;
+    } else if (max < UINT16_MAX) {
+        width = 2;
+        missing = UINT16_MAX;
+    } else {
+        width = 4;
+        missing = UINT32_MAX;
+    }
+
+    data = calloc(N > 0 ? N : 1, width);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (n = 0; n < N; n++) {
+        j = isnan(x[n]) ? missing : value_index(pd, x[n]);
+        switch (width) {
+        case 1: ((uint8_t *) data)[n] = j; break;
+        case 2: ((uint16_t *) data)[n] = j; break;
+        case 4: ((uint32_t *) data)[n] = j; break;
+        }
+    }
+    q->data[k] = data;
+    q->width[k] = width;
+    return 0;
+}
+
+/*
+ * Quantize metric parameters of dataset `ds` of `N` elements with
+ * a non-zero fragment size. Other parameters are left as they are.
+ * Returns quantized parameters, which should be freed with free_quantized,
+ * or NULL on failure.
+ */
+struct tc_quantized *
+quantize(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+) {
+    size_t k = 0;
+    struct tc_quantized *q = NULL;
+
+    q = calloc(1, sizeof(struct tc_quantized));
+    if (q == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    q->K = K;
+    q->data = calloc(K > 0 ? K : 1, sizeof(void *));
+    q->width = calloc(K > 0 ? K : 1, sizeof(unsigned));
+    if (q->data == NULL || q->width == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+    for (k = 0; k < K; k++) {
+        if (param_def[k].type != TC_METRIC || !(param_def[k].fragment_size > 0))
+            continue;
+        if (quantize_column(&param_def[k], ds[k], N, q, k) != 0)
+            goto error;
+    }
+    return q;
+error:
+    free_quantized(q);
+    return NULL;
+}
+
+/*
+ * Free quantized parameters `q`.
+ */
+void
+free_quantized(struct tc_quantized *q)
+{
+    size_t k = 0;
+    if (q == NULL) return;
+    if (q->data != NULL) {
+        for (k = 0; k < q->K; k++)
+            free(q->data[k]);
+    }
+    free(q->data);
+    free(q->width);
+    free(q);
+}
@@ -0,0 +1,38 @@
+/*
+ * quantize.h
+ *
+ * Quantization of metric parameters into fragment indices.
+ *
+ */
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tc.h"
+
+struct tc_quantized {
+    size_t K; /* Number of parameters. */
+    void **data; /* Fragment indices of every parameter, or NULL. */
+    unsigned *width; /* Bytes per fragment index, or 0 if not quantized. */
+};
+
+double fragment_cut(const struct tc_param_def *pd, int64_t j);
+
+int64_t fragment_index(const struct tc_param_def *pd, double cut);
+
+int64_t value_index(const struct tc_param_def *pd, double x);
+
+struct tc_quantized *
+quantize(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+);
+
+void free_quantized(struct tc_quantized *q);
+
+#endif /* QUANTIZE_H */
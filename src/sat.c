@@ -0,0 +1,204 @@
+/*
+ * sat.c
+ *
+ * Summed-area table of elements over the grid of fragments.
+ *
+ * For datasets of up to SAT_MAX_K metric parameters with a non-zero
+ * fragment size and no missing values, the table holds at grid point
+ * (t1, ..., tK) the number of elements whose fragment index is less than
+ * tk in every parameter k. Since cuts lie on the grid, an element falls
+ * between cuts a and b exactly if its fragment index is in
+ * [fragment_index(a) + 1, fragment_index(b) + 1), and the population
+ * of any segment is a sum of 2^K table entries.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "quantize.h"
+#include "sat.h"
+#include "tc.h"
+
+/*
+ * Build a summed-area table of dataset `ds` of `N` elements. `budget` is
+ * the maximum size of the table in bytes. Returns the table, which should
+ * be freed with free_sat, or NULL on failure. errno is set to ENOTSUP
+ * if the dataset is not suitable or the table exceeds the budget.
+ */
+struct tc_sat *
+new_sat(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t budget
+) {
+    size_t n = 0, k = 0, t = 0, cells = 1;
+    int64_t j = 0;
+    const double *x = NULL;
+    struct tc_sat *sat = NULL;
+
+    if (K == 0 || K > SAT_MAX_K || N > UINT32_MAX) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    sat = calloc(1, sizeof(struct tc_sat));
+    if (sat == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sat->ds = ds;
+    sat->N = N;
+    sat->param_def = param_def;
+    sat->K = K;
+
+    for (k = 0; k < K; k++) {
+        if (param_def[k].type != TC_METRIC ||
+            param_def[k].size != TC_FLOAT64 ||
+            !(param_def[k].fragment_size > 0)) {
+            errno = ENOTSUP;
+            goto error;
+        }
+        x = ds[k];
+        sat->dims[k] = 1;
+        for (n = 0; n < N; n++) {
+            /* Also rejects missing and infinite values. */
+            if (!((x[n] - param_def[k].min.float64)/
+                param_def[k].fragment_size < budget/sizeof(uint32_t))) {
+                errno = ENOTSUP;
+                goto error;
+            }
+            sat->dims[k] = MAX(
+                sat->dims[k],
+                (size_t) value_index(&param_def[k], x[n]) + 2
+            );
+        }
+        if (sat->dims[k] > budget/sizeof(uint32_t)/cells) {
+            errno = ENOTSUP;
+            goto error;
+        }
+        sat->stride[k] = cells;
+        cells *= sat->dims[k];
+    }
+
+    sat->table = calloc(cells, sizeof(uint32_t));
+    if (sat->table == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+    /*
+     * Count elements by grid cell, then sum along every parameter
+     * in turn.
+     */
+    for (n = 0; n < N; n++) {
+        t = 0;
+        for (k = 0; k < K; k++) {
+            j = value_index(&param_def[k], ((const double *) ds[k])[n]);
+            t += (j + 1)*sat->stride[k];
+        }
+        sat->table[t]++;
+    }
+    for (k = 0; k < K; k++) {
+        for (t = 0; t < cells; t++) {
+            if (t/sat->stride[k] % sat->dims[k] != 0)
+                sat->table[t] += sat->table[t - sat->stride[k]];
+        }
+    }
+    return sat;
+error:
+    free_sat(sat);
+    return NULL;
+}
+
+/*
+ * Free summed-area table `sat`.
+ */
+void
+free_sat(struct tc_sat *sat)
+{
+    if (sat == NULL) return;
+    free(sat->table);
+    free(sat);
+}
+
+/*
+ * Return the grid point of parameter `k` just above cut `cut`, i.e. the
+ * least fragment index of elements above the cut.
+ */
+size_t
+sat_bound(const struct tc_sat *sat, size_t k, double cut)
+{
+    int64_t j = fragment_index(&sat->param_def[k], cut) + 1;
+    if (j < 0) return 0;
+    return MIN((size_t) j, sat->dims[k] - 1);
+}
+
+/*
+ * Return the number of elements with fragment index in [lo[k], hi[k])
+ * in every parameter k (inclusion-exclusion over corners of the box).
+ */
+size_t
+sat_count(const struct tc_sat *sat, const size_t *lo, const size_t *hi)
+{
+    size_t k = 0, t = 0;
+    unsigned corner = 0;
+    int64_t NX = 0;
+    bool odd = false;
+
+    for (k = 0; k < sat->K; k++) {
+        if (lo[k] >= hi[k])
+            return 0;
+    }
+    for (corner = 0; corner < (1u << sat->K); corner++) {
+        t = 0;
+        odd = false;
+        for (k = 0; k < sat->K; k++) {
+            if (corner & (1u << k)) {
+                if (lo[k] == 0)
+                    break; /* Nothing below the grid. */
+                t += lo[k]*sat->stride[k];
+                odd = !odd;
+            } else {
+                t += hi[k]*sat->stride[k];
+            }
+        }
+        if (k < sat->K)
+            continue;
+        NX += odd ? -(int64_t) sat->table[t] : (int64_t) sat->table[t];
+    }
+    return NX;
+}
+
+/*
+ * Return the number of elements in the box of node `node` with range
+ * in parameter `param` replaced by (`min`, `max`). Bounds of the root box
+ * include all elements. Used for evaluating proposals before the tree
+ * is changed.
+ */
+size_t
+sat_range_count(
+    const struct tc_sat *sat,
+    const struct tc_node *node,
+    size_t param,
+    double min,
+    double max
+) {
+    size_t k = 0;
+    size_t lo[SAT_MAX_K], hi[SAT_MAX_K];
+    double a = 0, b = 0;
+    const struct tc_param_def *pd = NULL;
+
+    for (k = 0; k < sat->K; k++) {
+        pd = &sat->param_def[k];
+        a = k == param ? min : node->box[2*k];
+        b = k == param ? max : node->box[2*k+1];
+        lo[k] = a == pd->min.float64 ? 0 : sat_bound(sat, k, a);
+        hi[k] = b == pd->max.float64 ? sat->dims[k] - 1 : sat_bound(sat, k, b);
+    }
+    return sat_count(sat, lo, hi);
+}
@@ -0,0 +1,53 @@
+/*
+ * sat.h
+ *
+ * Summed-area table of elements over the grid of fragments.
+ *
+ */
+
+#ifndef SAT_H
+#define SAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tc.h"
+
+/* Maximum number of parameters of a summed-area table. */
+#define SAT_MAX_K 3
+
+struct tc_sat {
+    const void **ds; /* Dataset. */
+    size_t N; /* Number of elements. */
+    const struct tc_param_def *param_def; /* Parameter definitions. */
+    size_t K; /* Number of parameters. */
+    size_t dims[SAT_MAX_K]; /* Number of fragment indices plus one. */
+    size_t stride[SAT_MAX_K]; /* Stride of every parameter in table. */
+    uint32_t *table; /* Number of elements below every grid point. */
+};
+
+struct tc_sat *
+new_sat(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t budget
+);
+
+void free_sat(struct tc_sat *sat);
+
+size_t sat_bound(const struct tc_sat *sat, size_t k, double cut);
+
+size_t sat_count(const struct tc_sat *sat, const size_t *lo, const size_t *hi);
+
+size_t
+sat_range_count(
+    const struct tc_sat *sat,
+    const struct tc_node *node,
+    size_t param,
+    double min,
+    double max
+);
+
+#endif /* SAT_H */
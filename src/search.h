@@ -0,0 +1,71 @@
+/*
+ * search.h
+ *
+ * Search of node cuts.
+ *
+ * Finding the child of a metric node to which a value belongs is the inner
+ * loop of routing elements through a tree. Both searches below are free
+ * of data-dependent branches, so that their cost does not depend on how
+ * well the branch predictor guesses the child.
+ *
+ */
+
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Maximum number of cuts searched linearly. */
+#define SEARCH_LINEAR 8
+
+/*
+ * Return the number of `n` cuts less than `x` by comparing `x` with
+ * all of them.
+ */
+static inline size_t
+search_linear(const double *cuts, size_t n, double x)
+{
+    size_t i = 0, c = 0;
+#ifdef __SSE2__
+    int m = 0;
+    __m128d v = _mm_set1_pd(x);
+    for (; i + 2 <= n; i += 2) {
+        m = _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(&cuts[i]), v));
+        c += (m & 1) + (m >> 1);
+    }
+#endif
+    for (; i < n; i++)
+        c += cuts[i] < x;
+    return c;
+}
+
+/*
+ * Return the number of `n` sorted cuts less than `x` by binary search.
+ * `n` has to be greater than 0.
+ */
+static inline size_t
+search_binary(const double *cuts, size_t n, double x)
+{
+    const double *base = cuts;
+    size_t half = 0;
+    while (n > 1) {
+        half = n/2;
+        base = base[half - 1] < x ? base + half : base;
+        n -= half;
+    }
+    return (base - cuts) + (*base < x);
+}
+
+/*
+ * Return the index of the child of a node with `n` sorted cuts `cuts`
+ * to which value `x` belongs, i.e. the number of cuts less than `x`.
+ * `x` must not be NaN.
+ */
+static inline size_t
+search_cuts(const double *cuts, size_t n, double x)
+{
+    if (n <= SEARCH_LINEAR)
+        return search_linear(cuts, n, x);
+    return search_binary(cuts, n, x);
+}
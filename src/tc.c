@@ -59,7 +59,7 @@ struct tc_tree *
 tc_new_tree(size_t size, const struct tc_param_def *param_def, size_t K)
 {
 	struct tc_tree *tree = NULL;
-	tree = calloc(1, sizeof(tree) + size);
+	tree = calloc(1, sizeof(struct tc_tree) + size);
 	if (tree == NULL) {
 		errno = ENOMEM;
 		goto error;
@@ -69,12 +69,16 @@ tc_new_tree(size_t size, const struct tc_param_def *param_def, size_t K)
 	tree->p = tree->buf;
 	tree->param_def = param_def;
 	tree->K = K;
+	if (init_catsets(tree) != 0)
+		goto error;
 	tree->root = tc_new_leaf(tree);
 	if (tree->root == NULL) {
 		errno = ENOMEM;
 		goto error;
 	}
-	tree_attach_node(tree->root);
+	if (tree_attach_node(tree->root) != 0)
+		goto error;
+	update_boxes(tree->root);
 	return tree;
 error:
 	if (tree != NULL) free(tree);
@@ -97,39 +101,38 @@ tc_new_node(
 	size_t i = 0;
 	struct tc_node *node = NULL;
 
-    node = tree_alloc(tree, sizeof(struct tc_node));
-    if (node == NULL) {
-    	errno = ENOMEM;
-    	return NULL;
-    }
-
-    node->nchildren = nchildren;
-    node->children = tree_alloc(tree, nchildren*sizeof(node->children));
-    if (node->children == NULL) {
-    	errno = ENOMEM;
-    	return NULL;
-    }
+	node = tree_alloc_node(tree);
+	if (node == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	node->tree = tree;
 	node->param = param;
 	node->ncuts = 0;
 	node->ncategories = 0;
+	node->nchildren = 0;
+	if (node_reserve(node, nchildren) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	node->nchildren = nchildren;
 
-	if (IS_METRIC(node)) {
+	if (nchildren == 0) {
+		/* Segment has no partitioning. */
+	} else if (IS_METRIC(node)) {
 		node->ncuts = nchildren > 0 ? nchildren - 1 : 0;
-		node->cuts = tree_alloc(tree, node->ncuts*sizeof(node->cuts));
-		if (node->cuts == NULL) {
-			errno = ENOMEM;
-			return NULL;
-		}
 		bcopy(
 			partitioning,
 			node->cuts,
-			node->ncuts*sizeof(node->cuts)
+			node->ncuts*sizeof(double)
 		);
 	} else if (IS_NOMINAL(node)) {
-		node->ncategories = PD(node)->max.int64 - PD(node)->min.int64 + 1;
-		node->categories = tree_alloc(tree, node->ncategories*sizeof(node->categories));
+		node->ncategories = NCATEGORIES(PD(node));
+		node->categories = tree_alloc(
+			tree,
+			node->ncategories*sizeof(int64_t)
+		);
 		if (node->categories == NULL) {
 			errno = ENOMEM;
 			return NULL;
@@ -137,7 +140,7 @@ tc_new_node(
 		bcopy(
 			partitioning,
 			node->categories,
-			node->ncategories*sizeof(node->categories)
+			node->ncategories*sizeof(int64_t)
 		);
 	} else assert(0);
 
@@ -173,7 +176,11 @@ tc_replace_node(
 		tree->root = node;
 	}
 	tree_detach_node(orig);
-	tree_attach_node(node);
+	if (tree_attach_node(node) != 0)
+		return -1;
+	update_boxes(node);
+	if (node->parent != NULL)
+		return update_supersegment(node->parent);
 	return 0;
 }
 
@@ -188,7 +195,7 @@ tc_free_segments(struct tc_segment *segments, size_t S)
 void
 tc_dump_tree_simple(const struct tc_tree *tree, const struct tc_node *node)
 {
-	size_t i = 0;
+	size_t i = 0, c = 0;
 	const struct tc_param_def *pd = NULL;
 	if (node == NULL) node = tree->root;
 	if (node == NULL) {
@@ -203,7 +210,10 @@ tc_dump_tree_simple(const struct tc_tree *tree, const struct tc_node *node)
 			if (i < node->ncuts - 1) printf(", ");
 		}
 	} else if (pd->type == TC_NOMINAL) {
-		/* Not implemented. */
+		for (c = 0; c < node->ncategories; c++) {
+			printf("%" PRId64, node->categories[c]);
+			if (c < node->ncategories - 1) printf(", ");
+		}
 	} else assert(0);
 	printf("], [");
 	for (i = 0; i < node->nchildren; i++) {
@@ -220,7 +230,7 @@ void
 tc_dump_segments_json(const struct tc_tree *tree, const void **ds, size_t N)
 {
     size_t S = 0;
-    size_t k = 0;
+    size_t k = 0, c = 0;
     struct tc_segment *segments = NULL;
     const struct tc_param_def *pd;
     segments = tc_segments(tree, ds, N, &S);
@@ -237,7 +247,13 @@ tc_dump_segments_json(const struct tc_tree *tree, const void **ds, size_t N)
 				range = segments[s].ranges[k];
 				printf("[%lf,%lf]", range.min, range.max);
 			} else if (pd->type == TC_NOMINAL) {
-				/* Not implemented. */
+				range = segments[s].ranges[k];
+				printf("[");
+				for (c = 0; c < range.ncategories; c++) {
+					if (c != 0) printf(",");
+					printf("%" PRId64, range.categories[c]);
+				}
+				printf("]");
 			} else assert(0);
 		}
 		printf("] }");
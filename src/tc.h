@@ -19,6 +19,9 @@
 
 extern size_t TC_SIZE[];
 
+/* Number of child nodes stored inline in a node. */
+#define TC_NODE_INLINE 4
+
 enum tc_param_type {
     TC_METRIC,
     TC_NOMINAL
@@ -48,6 +51,17 @@ struct tc_param_def {
     double fragment_size; /* Fragment size. */
 };
 
+struct tc_quantized;
+struct tc_sat;
+struct tc_log;
+struct pool;
+
+struct tc_node_set {
+    struct tc_node **nodes; /* Nodes of the set. */
+    size_t n; /* Number of nodes. */
+    size_t size; /* Capacity of nodes. */
+};
+
 struct tc_tree {
     const struct tc_param_def *param_def; /* Parameter definitions. */
     size_t K; /* Number of parameters. */
@@ -56,6 +70,23 @@ struct tc_tree {
     struct tc_node *first; /* First node (for sequential traversing). */
     struct tc_node *last; /* Last node (for sequential traversing). */
     struct tc_node *root; /* Root node. */
+    struct tc_node *free_nodes; /* Free nodes (linked by next). */
+    struct tc_node_set segments; /* Segments. */
+    struct tc_node_set supersegments; /* Supersegments. */
+    size_t N; /* Number of elements. */
+    size_t *elements; /* Elements partitioned by node. */
+    const void **ds; /* Dataset of elements, or NULL. */
+    const uint32_t *weights; /* Weights of elements, or NULL. */
+    uint64_t *cumw; /* Cumulative weights of elements, or NULL. */
+    size_t chain; /* Chain which generated the tree. */
+    const double *lfact; /* Table of log(n!), or NULL. */
+    size_t nlfact; /* Number of entries of lfact. */
+    const struct tc_quantized *quantized; /* Fragment indices, or NULL. */
+    const struct tc_sat *sat; /* Summed-area table of elements, or NULL. */
+    const void **stats_ds; /* Dataset counted exactly by NX of nodes, or NULL. */
+    struct pool *pool; /* Threads routing elements in tc_segments, or NULL. */
+    size_t *catset_off; /* Offset of every parameter in node catsets. */
+    size_t catset_words; /* Number of words of node catsets. */
     uint8_t buf[]; /* Buffer in which nodes are stored. */
 };
 
@@ -66,22 +97,55 @@ struct tc_node {
     size_t param; /* Parameter number. */
     double *cuts; /* Cuts. */
     size_t ncuts; /* Number of cuts. */
-    int64_t *categories; /* Categories partitioning. */
+    int64_t *categories; /* Child of every category (partitioning). */
     size_t ncategories; /* Number of categories. */
     struct tc_node **children; /* Child nodes. */
     struct tc_node *next; /* Next node (for sequential traversing). */
     struct tc_node *prev; /* Previous node (for sequential traversing). */
+    size_t off; /* Offset of elements of node in tree elements. */
+    size_t NX; /* Number of elements in node. */
+    double *box; /* Range in every parameter (min, max pairs). */
+    double V; /* Volume of node. */
+    uint64_t *catsets; /* Categories of nominal parameters (bitsets). */
+    size_t capacity; /* Capacity of children and cuts. */
+    size_t index; /* Index in segments or supersegments of tree, or -1. */
+    size_t *movable; /* Movable cuts. */
+    size_t nmovable; /* Number of movable cuts. */
     void *_aux; /* Auxillary data for any purpose. */
+    struct tc_node *_children[TC_NODE_INLINE]; /* Inline child nodes. */
+    double _cuts[TC_NODE_INLINE - 1]; /* Inline cuts. */
+    size_t _movable[TC_NODE_INLINE - 1]; /* Inline movable cuts. */
+};
+
+struct tc_diagnostics {
+    size_t nsamples; /* Number of samples per chain used. */
+    double l_rhat; /* Split-R-hat of log-likelihood. */
+    double S_rhat; /* Split-R-hat of number of segments. */
 };
 
 struct tc_opts {
     size_t nsamples; /* Number of samples to generate (excl. burn-in). */
+    size_t burnin; /* Number of samples to discard at the start. */
+    size_t thin; /* Pass only every thin-th sample (0 or 1 for all). */
     size_t maxiter; /* Maximum number of iterations. */
     double split_p; /* Probability of split. */
     double merge_p; /* Probability of merge. */
     double move_p; /* Probability of move. */
     double move_sd_frac; /* Move standard deviation as a fraction. */
     size_t max_segments; /* Maximum number of segments. */
+    size_t nchains; /* Number of chains. */
+    size_t nthreads; /* Number of threads (0 for number of processors). */
+    struct tc_diagnostics *diagnostics; /* Diagnostics output or NULL. */
+    size_t ntemps; /* Number of temperatures of parallel tempering. */
+    double temp_ratio; /* Ratio of adjacent temperatures. */
+    size_t swap_interval; /* Number of iterations between exchanges. */
+    uint64_t seed; /* Seed of random number generator. */
+    bool quantize; /* Quantize metric parameters into fragment indices. */
+    size_t sat_budget; /* Memory budget of summed-area table in bytes. */
+    struct tc_log *log; /* Sample log, or NULL. */
+    double subsample_eps; /* Error bound of subsampled acceptance (0 for exact). */
+    const uint32_t *weights; /* Weight of every element, or NULL. */
+    size_t route_nthreads; /* Threads routing elements in tc_segments. */
 };
 
 extern struct tc_opts tc_default_opts;
@@ -100,6 +164,67 @@ struct tc_segment {
     struct tc_range *ranges;
 };
 
+struct tc_segment_view {
+    size_t NX; /* Number of elements. */
+    double V; /* Volume. */
+    const double *ranges; /* Range in every parameter (min, max pairs). */
+    const uint64_t *catsets; /* Categories of nominal parameters (bitsets). */
+};
+
+struct tc_segment_cursor {
+    const struct tc_tree *tree; /* Tree. */
+    size_t s; /* Next segment. */
+};
+
+struct tc_compiled_tree {
+    const struct tc_param_def *param_def; /* Parameter definitions. */
+    size_t K; /* Number of parameters. */
+    size_t nnodes; /* Number of nodes. */
+    size_t S; /* Number of segments. */
+    uint32_t *param; /* Parameter of node. */
+    uint32_t *nchildren; /* Number of child nodes of node. */
+    uint32_t *child; /* First child of node, or segment number of a leaf. */
+    uint32_t *off; /* Offset of node cuts or categories. */
+    double *min; /* Minimum of node range, or the first category. */
+    double *max; /* Maximum of node range, or the number of categories. */
+    double *cuts; /* Cuts of metric nodes. */
+    uint32_t *categories; /* Child of every category of nominal nodes. */
+};
+
+struct tc_dataset {
+    size_t N; /* Number of elements. */
+    size_t K; /* Number of parameters. */
+    struct tc_param_def *param_def; /* Parameter definitions. */
+    const void **ds; /* Values of every parameter (in the mapping). */
+    void *map; /* Memory mapping of the file. */
+    size_t size; /* Size of the mapping in bytes. */
+};
+
+struct tc_deduped {
+    size_t N; /* Number of unique rows. */
+    size_t K; /* Number of parameters. */
+    const void **ds; /* Values of every parameter of unique rows. */
+    uint32_t *weights; /* Number of elements of every unique row. */
+    size_t *index; /* Unique row of every element of the original dataset. */
+};
+
+struct tc_log_sample {
+    size_t chain; /* Chain which generated the sample. */
+    double l; /* Log-likelihood. */
+};
+
+struct tc_log_reader {
+    size_t K; /* Number of parameters. */
+    struct tc_param_def *param_def; /* Parameter definitions. */
+    size_t nsamples; /* Number of samples. */
+    struct tc_log_sample *samples; /* Chain and log-likelihood of samples. */
+    void *map; /* Memory mapping of the file. */
+    size_t size; /* Size of the mapping in bytes. */
+    void *entries; /* Location of every sample in the file. */
+    struct tc_tree *tree; /* Tree of the last sample read. */
+    size_t current; /* Last sample read, or -1. */
+};
+
 typedef bool tc_clustering_cb(
     const struct tc_tree *tree,
     double l,
@@ -162,6 +287,97 @@ tc_segments(
     size_t *S
 );
 
+size_t
+tc_segments_into(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    struct tc_segment_view *buf,
+    double *ranges_buf,
+    uint64_t *catsets_buf,
+    size_t cap
+);
+
+void
+tc_segment_cursor_init(
+    struct tc_segment_cursor *cursor,
+    const struct tc_tree *tree
+);
+
+bool
+tc_segment_next(
+    struct tc_segment_cursor *cursor,
+    struct tc_segment_view *view
+);
+
+struct tc_compiled_tree *tc_compile_tree(const struct tc_tree *tree);
+
+size_t
+tc_compiled_segment(
+    const struct tc_compiled_tree *ct,
+    const void *ds[],
+    size_t n
+);
+
+void
+tc_compiled_segments(
+    const struct tc_compiled_tree *ct,
+    const void *ds[],
+    size_t off,
+    size_t N,
+    uint32_t *segment_ids
+);
+
+void tc_free_compiled_tree(struct tc_compiled_tree *ct);
+
+int
+tc_assign(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    uint32_t *segment_ids,
+    size_t nthreads
+);
+
+struct tc_dataset *tc_dataset_open(const char *filename);
+
+void tc_dataset_close(struct tc_dataset *dataset);
+
+int
+tc_dataset_write(
+    const char *filename,
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+);
+
+struct tc_deduped *
+tc_dedupe(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+);
+
+void tc_deduped_free(struct tc_deduped *deduped);
+
+struct tc_log *
+tc_log_open(
+    const char *filename,
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t interval
+);
+
+int tc_log_close(struct tc_log *log);
+
+struct tc_log_reader *tc_log_reader_open(const char *filename);
+
+void tc_log_reader_close(struct tc_log_reader *reader);
+
+const struct tc_tree *tc_log_read(struct tc_log_reader *reader, size_t i);
+
 void
 tc_dump_tree_simple(const struct tc_tree *tree, const struct tc_node *node);
 
@@ -0,0 +1,79 @@
+/*
+ * tc_assign.c
+ *
+ * tc_assign implementation.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "pool.h"
+#include "tc.h"
+
+/* Number of elements routed by one task. */
+#define CHUNK_SIZE 65536
+
+struct assign_task {
+    const struct tc_compiled_tree *ct;
+    const void **ds;
+    size_t N;
+    uint32_t *segment_ids;
+};
+
+static void
+assign_chunk(void *arg, size_t i)
+{
+    size_t off = 0;
+    struct assign_task *t = arg;
+
+    off = i*CHUNK_SIZE;
+    tc_compiled_segments(
+        t->ct,
+        t->ds,
+        off,
+        MIN(CHUNK_SIZE, t->N - off),
+        &t->segment_ids[off]
+    );
+}
+
+int
+tc_assign(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    uint32_t *segment_ids,
+    size_t nthreads
+) {
+    size_t nchunks = 0;
+    struct tc_compiled_tree *ct = NULL;
+    struct pool *pool = NULL;
+    struct assign_task t;
+
+    ct = tc_compile_tree(tree);
+    if (ct == NULL)
+        goto error;
+
+    nchunks = (N + CHUNK_SIZE - 1)/CHUNK_SIZE;
+    if (nthreads == 0)
+        nthreads = pool_default_nthreads();
+    pool = pool_new(MIN(nthreads, MAX(nchunks, 1)));
+    if (pool == NULL)
+        goto error;
+
+    t.ct = ct;
+    t.ds = ds;
+    t.N = N;
+    t.segment_ids = segment_ids;
+    pool_run(pool, assign_chunk, &t, nchunks);
+
+    pool_free(pool);
+    tc_free_compiled_tree(ct);
+    return 0;
+error:
+    if (pool != NULL) pool_free(pool);
+    if (ct != NULL) tc_free_compiled_tree(ct);
+    return -1;
+}
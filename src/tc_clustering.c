@@ -12,21 +12,55 @@
 #include <math.h>
 #include <errno.h>
 #include <mcheck.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "misc.h"
 #include "tree.h"
+#include "elements.h"
+#include "pool.h"
+#include "quantize.h"
+#include "sat.h"
+#include "log.h"
 #include "tc.h"
 
 struct tc_opts tc_default_opts = {
     .nsamples = 10,
+    .burnin = 0,
+    .thin = 1,
     .maxiter = 0,
     .split_p = 0.1,
     .merge_p = 0.1,
     .move_p = 0.8,
     .move_sd_frac = 0.1,
-    .max_segments = 0
+    .max_segments = 0,
+    .nchains = 1,
+    .nthreads = 0,
+    .diagnostics = NULL,
+    .ntemps = 1,
+    .temp_ratio = 2,
+    .swap_interval = 100,
+    .seed = 0,
+    .quantize = false,
+    .sat_budget = 64 << 20,
+    .log = NULL,
+    .subsample_eps = 0,
+    .weights = NULL,
+    .route_nthreads = 1
 };
 
+/* Initial size of tree buffer in bytes. */
+#define TREE_SIZE 10000024
+
+/* Number of elements of the first subsample of a sequential test. */
+#define SUBSAMPLE_SIZE 256
+
+/* Largest fraction of a segment subsampled before exact evaluation. */
+#define SUBSAMPLE_MAX_FRAC 0.125
+
+/* Maximum number of steps of a sequential test. */
+#define SUBSAMPLE_MAX_STEPS 48
+
 enum action {
     MOVE,
     SPLIT,
@@ -44,6 +78,14 @@ check_opts(const struct tc_opts *opts)
     cond = opts->merge_p + opts->split_p + opts->move_p == 1;
     if (!cond) return false;
 
+    if (opts->ntemps > 1) {
+        if (!(opts->temp_ratio >= 1) || opts->swap_interval == 0)
+            return false;
+    }
+
+    if (!(opts->subsample_eps >= 0 && opts->subsample_eps < 0.5))
+        return false;
+
     return true;
 }
 
@@ -69,12 +111,12 @@ check_pd(const struct tc_param_def *pd)
     if (pd->type == TC_NOMINAL) {
         if (pd->size != TC_INT64)
             return false;
-        if (!(pd->min.int64 <= pd->max.float64))
+        if (!(pd->min.int64 <= pd->max.int64))
             return false;
     }
 
     /* Check if limits are a multiple of fragment_size. */
-    if (pd->fragment_size > 0) {
+    if (pd->type == TC_METRIC && pd->fragment_size > 0) {
         if (pd->min.float64 - fmod(pd->min.float64, pd->fragment_size)
             != pd->min.float64)
             return false;
@@ -85,40 +127,1113 @@ check_pd(const struct tc_param_def *pd)
     return true;
 }
 
-int
-tc_clustering(
+/*
+ * Returns true if dataset `ds` of `N` elements has a missing value
+ * of a metric parameter.
+ */
+static bool
+has_missing(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+) {
+    size_t n = 0, k = 0;
+    const double *x = NULL;
+
+    for (k = 0; k < K; k++) {
+        if (param_def[k].type != TC_METRIC)
+            continue;
+        x = ds[k];
+        for (n = 0; n < N; n++) {
+            if (isnan(x[n]))
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Check categories of nominal parameters of dataset `ds` of `N` elements.
+ * Returns true if all are between min and max of their parameter, which
+ * the sampler requires to look them up in category bitsets.
+ */
+static bool
+check_categories(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+) {
+    size_t n = 0, k = 0;
+    const int64_t *c = NULL;
+
+    for (k = 0; k < K; k++) {
+        if (param_def[k].type != TC_NOMINAL)
+            continue;
+        c = ds[k];
+        for (n = 0; n < N; n++) {
+            if (c[n] < param_def[k].min.int64 ||
+                c[n] > param_def[k].max.int64)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Sum weights `weights` of dataset `ds` of `N` elements into `W`. Returns
+ * true if the weights are valid, or false if an element with a missing
+ * value has a weight other than 1, which the sampler cannot divide.
+ */
+static bool
+sum_weights(
     const void *ds[],
     size_t N,
     const struct tc_param_def param_def[],
     size_t K,
-    tc_clustering_cb cb,
-    void *cb_data,
-    const struct tc_opts *opts
+    const uint32_t *weights,
+    size_t *W
 ) {
-    struct tc_tree *tree = NULL;
+    size_t n = 0, k = 0;
+
+    *W = 0;
+    for (n = 0; n < N; n++)
+        *W += weights[n];
+    for (k = 0; k < K; k++) {
+        if (param_def[k].type != TC_METRIC)
+            continue;
+        for (n = 0; n < N; n++) {
+            if (isnan(((const double *) ds[k])[n]) && weights[n] != 1)
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Log-likelihood contribution of segment `node`.
+ */
+static double
+node_log_likelihood(const struct tc_node *node)
+{
+    return segment_log_likelihood(node->tree, node_weight(node), node->V);
+}
+
+/*
+ * Trace of a chain kept for convergence diagnostics.
+ */
+struct trace {
+    double *l; /* Log-likelihood of samples. */
+    double *S; /* Number of segments of samples. */
+    size_t n; /* Number of samples. */
+    size_t size; /* Capacity of l and S. */
+};
+
+/*
+ * State of a chain. With parallel tempering, every chain consists
+ * of several replicas at different temperatures, each of which has its
+ * own state.
+ */
+struct chain {
+    size_t id; /* Chain number. */
+    size_t temp; /* Temperature number (0 for T = 1). */
+    double beta; /* Inverse temperature. */
+    struct tc_tree *tree; /* Current tree. */
+    struct rng rng; /* Random number generator. */
+    double l; /* Log-likelihood. */
+    size_t S; /* Number of segments. */
+    size_t niter; /* Number of iterations. */
+    size_t nsamples; /* Number of samples passed to the callback. */
+    size_t naccepted; /* Number of samples incl. burn-in and thinning. */
+    struct trace trace; /* Trace of samples. */
+    struct log_chain log; /* Proposals accepted since the last logged sample. */
+    int err; /* errno of failure, or 0. */
+    bool done; /* Chain has finished. */
+};
+
+/*
+ * Clustering run shared by chains.
+ */
+struct run {
+    const void **ds;
+    size_t N;
+    size_t W; /* Total weight of elements. */
+    const struct tc_param_def *param_def;
+    size_t K;
+    tc_clustering_cb *cb;
+    void *cb_data;
+    const struct tc_opts *opts;
+    struct chain *chains; /* Replicas of chain j are ntemps*j, ... */
+    size_t nchains;
+    size_t ntemps; /* Number of temperatures. */
+    size_t nreplicas; /* Number of replicas of all chains. */
+    double *lfact; /* Table of log(n!) shared by trees. */
+    size_t nlfact; /* Number of entries of lfact. */
+    struct tc_quantized *quantized; /* Fragment indices, or NULL. */
+    struct tc_sat *sat; /* Summed-area table of elements, or NULL. */
+    struct pool *route_pool; /* Threads routing elements, or NULL. */
+    bool complete; /* Dataset has no missing values. */
+    bool subsample; /* Decide splits from subsamples. */
+    double subsample_z[SUBSAMPLE_MAX_STEPS]; /* Critical values by step. */
+    pthread_mutex_t mutex; /* Serializes callbacks. */
+    bool stop; /* Callback requested to stop. */
+};
+
+/*
+ * Append sample of `chain` to its trace. Returns 0 on success, -1 on failure.
+ */
+static int
+trace_append(struct chain *chain)
+{
+    struct trace *trace = &chain->trace;
+    size_t size = 0;
+    double *l = NULL, *S = NULL;
+
+    if (trace->n == trace->size) {
+        size = MAX(2*trace->size, 1024);
+        l = realloc(trace->l, size*sizeof(double));
+        if (l == NULL) goto error;
+        trace->l = l;
+        S = realloc(trace->S, size*sizeof(double));
+        if (S == NULL) goto error;
+        trace->S = S;
+        trace->size = size;
+    }
+    trace->l[trace->n] = chain->l;
+    trace->S[trace->n] = chain->S;
+    trace->n++;
+    return 0;
+error:
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Return the split potential scale reduction factor (split-R̂) of `m`
+ * chains of `n` draws each. `x[j]` are draws of chain `j`. Every chain
+ * is split in halves, which are compared as separate chains. Returns NAN
+ * if there are not enough draws.
+ */
+static double
+split_rhat(double *const x[], size_t m, size_t n)
+{
+    size_t j = 0, h = 0, i = 0, half = n/2;
+    double mean = 0, var = 0, d = 0;
+    double W = 0, B = 0, all = 0, var_plus = 0;
+    const double *y = NULL;
+
+    if (m == 0 || half < 2)
+        return NAN;
+    for (j = 0; j < m; j++) {
+        for (h = 0; h < 2; h++) {
+            /* Second half skips the middle draw of odd chains. */
+            y = x[j] + h*(n - half);
+            mean = 0;
+            for (i = 0; i < half; i++)
+                mean += y[i];
+            mean /= half;
+            var = 0;
+            for (i = 0; i < half; i++) {
+                d = y[i] - mean;
+                var += d*d;
+            }
+            W += var/(half - 1);
+            B += mean*mean;
+            all += mean;
+        }
+    }
+    W /= 2*m;
+    all /= 2*m;
+    B = half*(B/(2*m) - all*all)*(2*m)/(2*m - 1);
+    if (W == 0)
+        return B == 0 ? 1 : INFINITY;
+    var_plus = (half - 1)*W/half + B/half;
+    return sqrt(var_plus/W);
+}
+
+/*
+ * Compute convergence diagnostics of chains of run `run` from the first
+ * samples of every chain, as many as the shortest chain has.
+ */
+static int
+diagnose(const struct run *run, struct tc_diagnostics *diagnostics)
+{
+    size_t j = 0, n = SIZE_MAX;
+    double **l = NULL, **S = NULL;
+
+    l = calloc(run->nchains, sizeof(double *));
+    S = calloc(run->nchains, sizeof(double *));
+    if (l == NULL || S == NULL) {
+        if (l != NULL) free(l);
+        if (S != NULL) free(S);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (j = 0; j < run->nchains; j++) {
+        n = MIN(n, run->chains[j*run->ntemps].trace.n);
+        l[j] = run->chains[j*run->ntemps].trace.l;
+        S[j] = run->chains[j*run->ntemps].trace.S;
+    }
+    diagnostics->nsamples = n;
+    diagnostics->l_rhat = split_rhat(l, run->nchains, n);
+    diagnostics->S_rhat = split_rhat(S, run->nchains, n);
+    free(l);
+    free(S);
+    return 0;
+}
+
+/*
+ * Initialize replica `r` of run `run` with a tree of a single segment.
+ * `rng` is the random number generator of the replica. Returns 0
+ * on success, -1 on failure.
+ */
+static int
+init_chain(
+    const struct run *run,
+    struct chain *chain,
+    size_t r,
+    const struct rng *rng
+) {
+    chain->id = r/run->ntemps;
+    chain->temp = r%run->ntemps;
+    chain->beta = pow(run->opts->temp_ratio, -(double) chain->temp);
+    chain->rng = *rng;
+    chain->tree = tc_new_tree(TREE_SIZE, run->param_def, run->K);
+    if (chain->tree == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    chain->tree->chain = chain->id;
+    chain->tree->lfact = run->lfact;
+    chain->tree->nlfact = run->nlfact;
+    chain->tree->quantized = run->quantized;
+    chain->tree->sat = run->sat;
+    /* Without missing values, segments count elements as tc_segments. */
+    chain->tree->stats_ds = run->complete ? run->ds : NULL;
+    chain->tree->ds = run->ds;
+    chain->tree->pool = run->route_pool;
+    log_chain_init(&chain->log);
+
+    /*
+     * Populations and volumes of segments are kept in the tree, and the
+     * log-likelihood is updated incrementally from the segments affected
+     * by a proposal.
+     */
+    if (init_elements(chain->tree, run->N, run->opts->weights) != 0)
+        return -1;
+    chain->S = 1;
+    chain->l = log_likelihood_norm(chain->tree, run->W, chain->S) +
+        node_log_likelihood(chain->tree->root);
+    return 0;
+}
+
+/*
+ * Free chain `chain`.
+ */
+static void
+free_chain(struct chain *chain)
+{
+    if (chain->tree != NULL) {
+        free_elements(chain->tree);
+        free(chain->tree);
+    }
+    if (chain->trace.l != NULL) free(chain->trace.l);
+    if (chain->trace.S != NULL) free(chain->trace.S);
+    log_chain_free(&chain->log);
+    chain->tree = NULL;
+}
+
+/*
+ * Returns true if accepted proposals of chain `chain` are recorded
+ * for the sample log. Nothing is recorded while the next sample will be
+ * a snapshot anyway, such as the first sample after the burn-in.
+ */
+static bool
+logging(const struct run *run, struct chain *chain)
+{
+    if (run->opts->log == NULL || chain->temp != 0)
+        return false;
+    if (chain->naccepted < run->opts->burnin)
+        log_chain_reset(&chain->log);
+    return !chain->log.snapshot;
+}
+
+/*
+ * Log-likelihood ratio of a split of segment `node` into parts of weight
+ * `NX1` and the rest of volume `V1` and `V2`.
+ */
+static double
+split_ratio(
+    const struct run *run,
+    const struct chain *chain,
+    const struct tc_node *node,
+    size_t NX1,
+    double V1,
+    double V2
+) {
+    const struct tc_tree *tree = chain->tree;
+    return -node_log_likelihood(node) +
+        segment_log_likelihood(tree, NX1, V1) +
+        segment_log_likelihood(tree, node_weight(node) - NX1, V2) -
+        log_likelihood_norm(tree, run->W, chain->S) +
+        log_likelihood_norm(tree, run->W, chain->S + 1);
+}
+
+/*
+ * Decide a split of segment `node` into parts of volume `V1` and `V2`
+ * given that the fraction of elements of the first part is within `w`
+ * of `p`, and uniform draw `log_u`. Returns 1 if the split is accepted
+ * for every such fraction, 0 if rejected for every such fraction, and -1
+ * otherwise.
+ */
+static int
+split_bound(
+    const struct run *run,
+    const struct chain *chain,
+    const struct tc_node *node,
+    double p,
+    double w,
+    double V1,
+    double V2,
+    double log_u
+) {
+    size_t NX = node->NX;
+    size_t lo = 0, hi = 0, mid = 0;
+    double r = V1/V2;
+    double dmin = 0, dmax = 0;
+
+    lo = NX*fmax(0, p - w);
+    hi = ceil(NX*fmin(1, p + w));
+    /*
+     * The ratio is convex in the number of elements of the first part,
+     * with minimum where (NX1 + 1)/(NX - NX1) = V1/V2.
+     */
+    mid = MIN(MAX(ceil((NX*r - 1)/(1 + r)), lo), hi);
+    dmin = chain->beta*split_ratio(run, chain, node, mid, V1, V2);
+    dmax = chain->beta*fmax(
+        split_ratio(run, chain, node, lo, V1, V2),
+        split_ratio(run, chain, node, hi, V1, V2)
+    );
+    if (log_u < dmin)
+        return 1;
+    if (log_u >= dmax)
+        return 0;
+    return -1;
+}
+
+/*
+ * Decide a split of segment `node` of chain `chain` in parameter `k` from
+ * a growing random subsample of its elements (austerity MH). The split is
+ * at cut `cut` of range (`min`, `max`) of a metric parameter, or by bitset
+ * `set` of categories of a nominal parameter if not NULL. `V1` and `V2`
+ * are volumes of the two parts.
+ *
+ * The split is decided once uniform draw `log_u` is on the same side of
+ * the log-likelihood ratio for the whole confidence interval of the
+ * subsample. Otherwise, the subsample doubles. Probability of a wrong
+ * decision is at most subsample_eps over all steps of the test (in the
+ * normal approximation). Returns 1 to accept, 0 to reject, and -1 if the
+ * test was inconclusive or not worthwhile, in which case the split should
+ * be evaluated exactly.
+ */
+static int
+subsample_split(
+    const struct run *run,
+    struct chain *chain,
+    const struct tc_node *node,
+    size_t k,
+    double cut,
+    double min,
+    double max,
+    const uint64_t *set,
+    double V1,
+    double V2,
+    double log_u
+) {
+    const struct tc_tree *tree = chain->tree;
+    struct rng *rng = &chain->rng;
+    size_t NX = node->NX;
+    size_t m = 0, n = SUBSAMPLE_SIZE, NX1 = 0, j = 0;
+    double mmax = NX*SUBSAMPLE_MAX_FRAC;
+    double p = 0, se = 0;
+    int res = 0;
+
+    /* Subsamples are of elements regardless of weight. */
+    if (tree->weights != NULL || !split_scans(tree, node, k) ||
+        !(V1 > 0 && V2 > 0))
+        return -1;
+
+    for (j = 0; m + n <= mmax && j < SUBSAMPLE_MAX_STEPS; j++) {
+        NX1 += set != NULL ?
+            subsample_categories(tree, run->ds, node, k, set, n, rng) :
+            subsample_elements(tree, run->ds, node, k, cut, min, max, n, rng);
+        m += n;
+        n = m;
+
+        p = (NX1 + 0.5)/(m + 1);
+        se = sqrt(p*(1 - p)/m);
+        res = split_bound(run, chain, node, p, run->subsample_z[j]*se,
+            V1, V2, log_u);
+        if (res != -1)
+            return res;
+        /* Give up if even the largest subsample is not likely to decide. */
+        if (split_bound(run, chain, node, p,
+            run->subsample_z[j]*se*sqrt(m/mmax), V1, V2, log_u) == -1)
+            return -1;
+    }
+    return -1;
+}
+
+/*
+ * Propose a split of segment `node` of chain `chain` in nominal parameter
+ * `k`. Categories of the segment are divided randomly into two non-empty
+ * sets, which become children of a new node. Returns 1 if the proposal
+ * was accepted, 0 if not, and -1 on failure.
+ */
+static int
+split_nominal(
+    const struct run *run,
+    struct chain *chain,
+    struct tc_node *node,
+    size_t k
+) {
+    const void **ds = run->ds;
+    const struct tc_param_def *pd = &run->param_def[k];
+    struct rng *rng = &chain->rng;
+    struct tc_tree *tree = chain->tree;
+    size_t W = run->W, S = chain->S;
+    size_t C = NCATEGORIES(pd), nwords = BITSET_WORDS(C);
+    size_t c = 0, n = 0, n1 = 0;
+    size_t NX1 = 0, W1 = 0, W2 = 0;
+    double V1 = 0, V2 = 0;
+    double lx = 0, p = 0;
+    double log_u = 0;
+    int decision = -1;
+    const uint64_t *set = NULL;
+    uint64_t *left_set = NULL;
+    int64_t *categories = NULL;
+    struct tc_node *new_node = NULL;
+    int res = 0;
+
+    set = node_catset(node, k);
+    n = bitset_count(set, nwords);
+    if (n < 2)
+        return 0; /* Nowhere to split. */
+
+    left_set = calloc(nwords, sizeof(uint64_t));
+    categories = calloc(C, sizeof(int64_t));
+    if (left_set == NULL || categories == NULL) {
+        errno = ENOMEM;
+        res = -1;
+        goto cleanup;
+    }
+    do {
+        n1 = 0;
+        for (c = 0; c < C; c++) {
+            categories[c] = 0;
+            BITSET_CLEAR(left_set, c);
+            if (!BITSET_GET(set, c))
+                continue;
+            if (frand(rng) < 0.5) {
+                BITSET_SET(left_set, c);
+                n1++;
+            } else {
+                categories[c] = 1;
+            }
+        }
+    } while (n1 == 0 || n1 == n);
+
+    V1 = range_volume(node, k, 0, n1);
+    V2 = range_volume(node, k, 0, n - n1);
+    if (run->subsample) {
+        log_u = log(frand1(rng));
+        decision = subsample_split(run, chain, node, k, 0, 0, 0, left_set,
+            V1, V2, log_u);
+        if (decision == 0)
+            goto cleanup;
+    }
+    NX1 = split_categories(tree, ds, node, k, left_set, &W1);
+    W2 = node_weight(node) - W1;
+    lx = chain->l - node_log_likelihood(node) +
+        segment_log_likelihood(tree, W1, V1) +
+        segment_log_likelihood(tree, W2, V2) -
+        log_likelihood_norm(tree, W, S) +
+        log_likelihood_norm(tree, W, S + 1);
+    if (run->subsample) {
+        if (decision != 1 && !(log_u < chain->beta*(lx - chain->l)))
+            goto cleanup;
+    } else {
+        p = fmin(1, exp(chain->beta*(lx - chain->l)));
+        if (!sample(rng, 2, (double[]){1-p, p}))
+            goto cleanup;
+    }
+    if (logging(run, chain) &&
+        log_split(&chain->log, node, k, 0, categories) != 0) {
+        res = -1;
+        goto cleanup;
+    }
+
+    apply_split_categories(tree, ds, node, k, left_set);
+    new_node = tc_new_node(tree, k, 2, categories);
+    if (new_node == NULL) {
+        errno = ENOMEM;
+        res = -1;
+        goto cleanup;
+    }
+    if (tc_replace_node(node, new_node) != 0) {
+        res = -1;
+        goto cleanup;
+    }
+    new_node->off = node->off;
+    new_node->NX = node->NX;
+    divide_elements(node, new_node->children[0], new_node->children[1], NX1);
+    tree_free_node(node);
+    assert(check_tree(tree));
+    chain->l = lx;
+    chain->S++;
+    res = 1;
+cleanup:
+    free(left_set);
+    free(categories);
+    return res;
+}
+
+/*
+ * Propose a move of supersegment `node` of chain `chain` with a nominal
+ * parameter. A random category of two adjacent segments is reassigned
+ * from one segment to the other, provided that it is not the last category
+ * of the segment. Returns 1 if the proposal was accepted, 0 if not.
+ */
+static int
+move_nominal(const struct run *run, struct chain *chain, struct tc_node *node)
+{
+    const void **ds = run->ds;
+    const struct tc_param_def *pd = &run->param_def[node->param];
+    struct rng *rng = &chain->rng;
+    struct tc_tree *tree = chain->tree;
+    size_t nwords = BITSET_WORDS(NCATEGORIES(pd));
+    size_t i = 0, c = 0, r = 0, n1 = 0, n2 = 0;
+    size_t W1 = 0, W2 = 0;
+    double V1 = 0, V2 = 0;
+    double lx = 0, p = 0;
+    const uint64_t *set1 = NULL, *set2 = NULL;
+    struct tc_node *left = NULL, *right = NULL;
+
+    c = sample(rng, count_movable_cuts(node), NULL);
+    i = select_movable_cut(node, c);
+    left = node->children[i];
+    right = node->children[i+1];
+    set1 = node_catset(left, node->param);
+    set2 = node_catset(right, node->param);
+    n1 = bitset_count(set1, nwords);
+    n2 = bitset_count(set2, nwords);
+    r = sample(rng, n1 + n2, NULL);
+    if (r < n1) {
+        if (n1 == 1) return 0;
+        c = bitset_select(set1, nwords, r);
+        n1--;
+        n2++;
+    } else {
+        if (n2 == 1) return 0;
+        c = bitset_select(set2, nwords, r - n1);
+        n1++;
+        n2--;
+    }
+
+    move_category(tree, ds, node, i, c, &W1);
+    W2 = node_weight(left) + node_weight(right) - W1;
+    V1 = range_volume(left, node->param, 0, n1);
+    V2 = range_volume(right, node->param, 0, n2);
+    lx = chain->l - node_log_likelihood(left) -
+        node_log_likelihood(right) +
+        segment_log_likelihood(tree, W1, V1) +
+        segment_log_likelihood(tree, W2, V2);
+    p = fmin(1, exp(chain->beta*(lx - chain->l)));
+    if (!sample(rng, 2, (double[]){1-p, p}))
+        return 0;
+    if (logging(run, chain) && log_move(&chain->log, node, i, 0, c) != 0)
+        return -1;
+
+    shift_category(tree, ds, node, i, c);
+    node->categories[c] = node->categories[c] == (int64_t) i ? i + 1 : i;
+    update_boxes(left);
+    update_boxes(right);
+    chain->l = lx;
+    return 1;
+}
+
+/*
+ * Make a Metropolis-Hastings step of chain `chain`, whose likelihood
+ * is raised to the power of its inverse temperature. Returns 1 if a proposal
+ * was accepted, 0 if not, and -1 on failure.
+ */
+static int
+step(const struct run *run, struct chain *chain)
+{
+    const void **ds = run->ds;
+    size_t W = run->W;
+    size_t K = run->K;
+    const struct tc_param_def *param_def = run->param_def;
+    const struct tc_opts *opts = run->opts;
+    struct rng *rng = &chain->rng;
+    struct tc_tree *tree = chain->tree;
+    double l = chain->l;
+    size_t S = chain->S;
     enum action action = 0; /* Action to take. */
-    double l = 0; /* Log-likelihood. */
     double lx = 0; /* Proposal log-likelihood. */
     double p = 0; /* Acceptance probability. */
     bool accept = false; /* Accept proposal? */
-    size_t nsamples = 0; /* Number of samples. */
-    size_t niter = 0; /* Number of iterations. */
-    size_t i = 0, j = 0, k = 0;
-    size_t S = 0, s = 0;
+    double log_u = 0; /* Log of uniform draw of subsampled acceptance. */
+    int decision = -1; /* Decision of subsampled acceptance. */
+    size_t i = 0, k = 0;
+    size_t s = 0;
     size_t SS = 0, ss = 0;
     size_t C = 0, c = 0;
+    size_t NX1 = 0, W1 = 0, W2 = 0;
+    double V1 = 0, V2 = 0;
     double w1 = 0, w2 = 0;
+    double min = 0, max = 0;
     struct tc_node *node = NULL, *parent = NULL;
-    struct tc_node *old_node = NULL, *new_node = NULL;
+    struct tc_node *new_node = NULL;
+    struct tc_node *left = NULL, *right = NULL, *merged = NULL;
     const struct tc_param_def *pd = NULL;
     struct tc_range range;
-    double *cuts = NULL;
     double cut;
     double new_cut;
-    bool res = false;
+
+    // tc_dump_tree_simple(tree, NULL);
+
+    action = sample(rng, 3, (double[]){
+        opts->move_p,
+        opts->split_p,
+        opts->merge_p
+    });
+
+    switch (action) {
+    case SPLIT:
+        if (opts->max_segments && S >= opts->max_segments)
+            return 0;
+        s = sample(rng, S, NULL);
+        node = select_segment(tree, s);
+        k = sample(rng, K, NULL);
+        parent = node->parent;
+
+        pd = &param_def[k];
+        if (pd->type == TC_NOMINAL)
+            return split_nominal(run, chain, node, k);
+        node_range(node, k, &range);
+        if (range.max - range.min <= pd->fragment_size)
+            return 0; /* Nowhere to split. */
+        cut = (range.min + pd->fragment_size) +
+            frand1(rng)*(range.max - (range.min + pd->fragment_size));
+        if (pd->fragment_size > 0) {
+            cut -= fmod(cut, pd->fragment_size);
+            /* Place the cut exactly on the grid of fragments. */
+            cut = fragment_cut(pd, fragment_index(pd, cut));
+        }
+        free_range(&range);
+        if (cut <= range.min || cut >= range.max)
+            return 0; /* Empty part. */
+
+        V1 = range_volume(node, k, range.min, cut);
+        V2 = range_volume(node, k, cut, range.max);
+        if (run->subsample) {
+            log_u = log(frand1(rng));
+            decision = subsample_split(run, chain, node, k, cut,
+                range.min, range.max, NULL, V1, V2, log_u);
+            if (decision == 0)
+                return 0;
+        }
+        NX1 = split_elements(tree, ds, node, k, cut, range.min, range.max,
+            rng, &W1);
+        W2 = node_weight(node) - W1;
+        lx = l - node_log_likelihood(node) +
+            segment_log_likelihood(tree, W1, V1) +
+            segment_log_likelihood(tree, W2, V2) -
+            log_likelihood_norm(tree, W, S) +
+            log_likelihood_norm(tree, W, S + 1);
+        if (run->subsample) {
+            accept = decision == 1 || log_u < chain->beta*(lx - l);
+        } else {
+            p = fmin(1, exp(chain->beta*(lx - l)));
+            accept = sample(rng, 2, (double[]){1-p, p});
+        }
+        if (!accept)
+            return 0;
+        if (logging(run, chain) &&
+            log_split(&chain->log, node, k, cut, NULL) != 0)
+            return -1;
+
+        // debug("SPLIT\n");
+        apply_split(tree, ds, node, k, cut, NX1, rng);
+        if (parent != NULL && k == parent->param) {
+            i = find_child(parent, node);
+            if (insert_cut(parent, i, cut) != 0)
+                return -1;
+            left = node;
+            right = parent->children[i+1];
+            divide_elements(node, left, right, NX1);
+        } else {
+            new_node = tc_new_node(tree, k, 2, (double[]){ cut });
+            if (new_node == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            if (tc_replace_node(node, new_node) != 0)
+                return -1;
+            new_node->off = node->off;
+            new_node->NX = node->NX;
+            left = new_node->children[0];
+            right = new_node->children[1];
+            divide_elements(node, left, right, NX1);
+            tree_free_node(node);
+        }
+        assert(check_tree(tree));
+        chain->l = lx;
+        chain->S++;
+        return 1;
+    case MERGE:
+        SS = count_supersegments(tree);
+        if (SS == 0) return 0;
+        ss = sample(rng, SS, NULL);
+        node = select_supersegment(tree, ss);
+        pd = &tree->param_def[node->param];
+        C = count_movable_cuts(node);
+        c = sample(rng, C, NULL);
+        i = select_movable_cut(node, c);
+        left = node->children[i];
+        right = node->children[i+1];
+        node_range(left, node->param, &range);
+        min = range.min;
+        w1 = range.max - range.min;
+        free_range(&range);
+        node_range(right, node->param, &range);
+        max = range.max;
+        w2 = range.max - range.min;
+        free_range(&range);
+        if (pd->type == TC_METRIC) {
+            V1 = range_volume(left, node->param, min, max);
+        } else if (pd->type == TC_NOMINAL) {
+            /* Merged segment has categories of both segments. */
+            V1 = range_volume(left, node->param, 0, w1 + w2);
+        } else assert(0);
+        lx = l - node_log_likelihood(left) -
+            node_log_likelihood(right) +
+            segment_log_likelihood(
+                tree,
+                node_weight(left) + node_weight(right),
+                V1
+            ) -
+            log_likelihood_norm(tree, W, S) +
+            log_likelihood_norm(tree, W, S - 1);
+        p = fmin(1, exp(chain->beta*(lx - l)));
+        accept = sample(rng, 2, (double[]){1-p, p});
+        // debug("l = %lf, lx = %lf, p = %lf\n", l, lx, p);
+        if (!accept)
+            return 0;
+        if (logging(run, chain) && log_merge(&chain->log, node, i) != 0)
+            return -1;
+
+        // debug("MERGE\n");
+        apply_merge(tree, ds, node, i);
+        if (node->nchildren > 2) {
+            merge_elements(left, right, left);
+            if (remove_cut(node, i) != 0)
+                return -1;
+            merged = left;
+        } else {
+            merged = tc_new_leaf(tree);
+            if (merged == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            if (tc_replace_node(node, merged) != 0)
+                return -1;
+            merge_elements(left, right, merged);
+            tree_free_node(node);
+        }
+        assert(check_tree(tree));
+        chain->l = lx;
+        chain->S--;
+        return 1;
+    case MOVE:
+        SS = count_supersegments(tree);
+        if (SS == 0) return 0;
+        // debug("SS = %zu\n", SS);
+        ss = sample(rng, SS, NULL);
+        node = select_supersegment(tree, ss);
+        pd = &param_def[node->param];
+        if (pd->type == TC_METRIC) {
+            C = count_movable_cuts(node);
+            c = sample(rng, C, NULL);
+            i = select_movable_cut(node, c);
+            cut = node->cuts[i];
+            left = node->children[i];
+            right = node->children[i+1];
+            node_range(left, node->param, &range);
+            min = range.min;
+            w1 = range.max - range.min;
+            free_range(&range);
+            node_range(right, node->param, &range);
+            max = range.max;
+            w2 = range.max - range.min;
+            free_range(&range);
+
+            if (w1 <= pd->fragment_size && w2 <= pd->fragment_size)
+                return 0; /* Nowhere to move. */
+
+            // debug("w1 = %lf, w2 = %lf\n", w1, w2);
+            new_cut = rtnorm(rng, 0, (w1 + w2)*opts->move_sd_frac, -w1, w2);
+            if (pd->fragment_size > 0)
+                new_cut -= fmod(new_cut, pd->fragment_size);
+            if (new_cut == 0) return 0;
+            new_cut += cut;
+            if (pd->fragment_size > 0)
+                new_cut = fragment_cut(pd, fragment_index(pd, new_cut));
+            if (new_cut <= min || new_cut >= max)
+                return 0; /* Empty segment. */
+            NX1 = move_elements(tree, ds, node, i, new_cut, &W1);
+            W2 = node_weight(left) + node_weight(right) - W1;
+            V1 = range_volume(left, node->param, min, new_cut);
+            V2 = range_volume(right, node->param, new_cut, max);
+            lx = l - node_log_likelihood(left) -
+                node_log_likelihood(right) +
+                segment_log_likelihood(tree, W1, V1) +
+                segment_log_likelihood(tree, W2, V2);
+            p = fmin(1, exp(chain->beta*(lx - l)));
+            accept = sample(rng, 2, (double[]){1-p, p});
+            if (!accept)
+                return 0;
+            if (logging(run, chain) &&
+                log_move(&chain->log, node, i, new_cut, 0) != 0)
+                return -1;
+
+            // debug("MOVE\n");
+            shift_elements(tree, ds, node, i, NX1);
+            node->cuts[i] = new_cut;
+            update_boxes(left);
+            update_boxes(right);
+            chain->l = lx;
+            return 1;
+        } else if (pd->type == TC_NOMINAL) {
+            return move_nominal(run, chain, node);
+        } else assert(0);
+        return 0;
+    default: assert(0);
+    }
+    return 0;
+}
+
+/*
+ * Write the current tree of chain `chain` to the sample log, if any,
+ * and pass it to the callback, if any. Samples of all chains are serialized.
+ * Returns 1 if the run should continue, 0 if it should stop, and -1
+ * on failure.
+ */
+static int
+deliver(struct run *run, struct chain *chain)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&run->mutex);
+    if (!run->stop) {
+        res = 1;
+        if (run->opts->log != NULL &&
+            log_sample(run->opts->log, &chain->log, chain->tree, chain->l) != 0)
+            res = -1;
+        else if (run->cb != NULL &&
+            !run->cb(chain->tree, chain->l, run->ds, run->N, run->cb_data))
+            res = 0;
+        if (res <= 0) run->stop = true;
+    }
+    pthread_mutex_unlock(&run->mutex);
+    return res;
+}
+
+/*
+ * Returns true if chain `chain` has generated the requested number
+ * of samples or reached the maximum number of iterations.
+ */
+static bool
+is_finished(const struct run *run, const struct chain *chain)
+{
+    return chain->nsamples >= run->opts->nsamples ||
+        (run->opts->maxiter != 0 && chain->niter >= run->opts->maxiter);
+}
+
+/*
+ * Pass a sample of chain `chain` at T = 1 to the callback, unless it falls
+ * in the burn-in or is thinned out. Returns 1 if the run should continue,
+ * 0 if it should stop, and -1 on failure.
+ */
+static int
+accept_sample(struct run *run, struct chain *chain)
+{
+    size_t thin = MAX(run->opts->thin, 1);
+
+    chain->naccepted++;
+    if (chain->naccepted <= run->opts->burnin ||
+        (chain->naccepted - run->opts->burnin) % thin != 0)
+        return 1;
+    chain->nsamples++;
+    if (run->opts->diagnostics != NULL && trace_append(chain) != 0)
+        return -1;
+    return deliver(run, chain);
+}
+
+/*
+ * Run replica `r` of run `arg`. Without tempering, the replica runs until
+ * its chain finishes or the callback requests to stop. With tempering,
+ * it runs for opts->swap_interval iterations, after which replicas
+ * are exchanged, and only samples at T = 1 are passed to the callback.
+ */
+static void
+run_chain(void *arg, size_t r)
+{
+    struct run *run = arg;
+    struct chain *chain = &run->chains[r];
+    const struct chain *cold = &run->chains[r - chain->temp];
+    const struct tc_opts *opts = run->opts;
+    size_t n = 0;
+    int res = 0;
+#ifdef DEBUG
+    double lx = 0;
+#endif /* DEBUG */
+
+    if (cold->done)
+        return;
+    for (n = 0; run->ntemps == 1 || n < opts->swap_interval; n++) {
+        if (chain->temp == 0 && is_finished(run, chain))
+            break;
+        if (tree_compact(&chain->tree, TREE_SIZE) != 0)
+            goto error;
+        assert(check_tree(chain->tree));
+        chain->niter++;
+
+        res = step(run, chain);
+        if (res < 0)
+            goto error;
+        if (res > 0 && chain->temp == 0) {
+            res = accept_sample(run, chain);
+            if (res < 0)
+                goto error;
+            if (res == 0)
+                break;
+        }
+
+#ifdef DEBUG
+        /*
+         * Verify the incremental log-likelihood by full evaluation,
+         * which does not use populations kept by the sampler. Elements
+         * with a missing value are routed to other segments than those
+         * the sampler chose for them.
+         */
+        if (run->complete) {
+            lx = routed_log_likelihood(chain->tree, run->ds, run->N);
+            if (fabs(lx - chain->l) > 1e-6*fabs(chain->l))
+                debug("log-likelihood mismatch: %lf != %lf\n", chain->l, lx);
+        }
+#endif /* DEBUG */
+    }
+    return;
+error:
+    chain->err = errno != 0 ? errno : ENOMEM;
+    /* Stop other chains too. */
+    pthread_mutex_lock(&run->mutex);
+    run->stop = true;
+    pthread_mutex_unlock(&run->mutex);
+}
+
+/*
+ * Exchange states of replicas `a` and `b`. Temperatures and random number
+ * generators stay with the replicas.
+ */
+static void
+swap_states(struct chain *a, struct chain *b)
+{
+    struct tc_tree *tree = a->tree;
+    double l = a->l;
+    size_t S = a->S;
+    a->tree = b->tree;
+    a->l = b->l;
+    a->S = b->S;
+    b->tree = tree;
+    b->l = l;
+    b->S = S;
+}
+
+/*
+ * Propose exchanges of states between replicas of adjacent temperatures
+ * of every chain, and mark finished chains. Called between rounds, when
+ * no replica is running. Returns 1 if any chain continues, 0 if all have
+ * finished, and -1 on failure.
+ */
+static int
+exchange(struct run *run)
+{
+    size_t j = 0, t = 0;
+    int res = 0, any = 0;
+    double p = 0;
+    struct chain *a = NULL, *b = NULL;
+
+    for (j = 0; j < run->nchains; j++) {
+        a = &run->chains[j*run->ntemps];
+        if (a->done) continue;
+        if (run->stop || is_finished(run, a)) {
+            a->done = true;
+            continue;
+        }
+        for (t = 0; t + 1 < run->ntemps; t++) {
+            a = &run->chains[j*run->ntemps + t];
+            b = a + 1;
+            p = fmin(1, exp((a->beta - b->beta)*(b->l - a->l)));
+            if (!sample(&run->chains[j*run->ntemps].rng, 2, (double[]){1-p, p}))
+                continue;
+            swap_states(a, b);
+            if (t == 0) {
+                log_chain_reset(&a->log);
+                res = accept_sample(run, a);
+                if (res < 0)
+                    return -1;
+                if (res == 0)
+                    break;
+            }
+        }
+        a = &run->chains[j*run->ntemps];
+        a->done = run->stop || is_finished(run, a);
+        if (!a->done) any = 1;
+    }
+    return any;
+}
+
+int
+tc_clustering(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K,
+    tc_clustering_cb cb,
+    void *cb_data,
+    const struct tc_opts *opts
+) {
+    size_t j = 0, k = 0;
+    size_t nthreads = 0;
+    int res = 0;
+    struct rng rng;
+    struct run run;
+    struct pool *pool = NULL;
+    bool mutex = false;
 
     mtrace();
 
+    run.chains = NULL;
+    run.nreplicas = 0;
+    run.lfact = NULL;
+    run.quantized = NULL;
+    run.sat = NULL;
+    run.route_pool = NULL;
+
     if (!check_opts(opts)) {
         errno = EINVAL;
         goto error;
@@ -130,236 +1245,136 @@ tc_clustering(
             goto error;
         }
     }
+    if (!check_categories(ds, N, param_def, K)) {
+        errno = EINVAL;
+        goto error;
+    }
+    if (opts->log != NULL && !log_matches(opts->log, param_def, K)) {
+        errno = EINVAL;
+        goto error;
+    }
 
-    init_gsl();
+    run.ds = ds;
+    run.N = N;
+    run.W = N;
+    if (opts->weights != NULL &&
+        !sum_weights(ds, N, param_def, K, opts->weights, &run.W)) {
+        errno = EINVAL;
+        goto error;
+    }
+    run.param_def = param_def;
+    run.K = K;
+    run.cb = cb;
+    run.cb_data = cb_data;
+    run.opts = opts;
+    run.stop = false;
+    run.complete = !has_missing(ds, N, param_def, K);
+    /*
+     * Step j of a sequential test errs with probability eps/2^(j+1),
+     * split between the two sides of its confidence interval.
+     */
+    run.subsample = opts->subsample_eps > 0;
+    for (j = 0; j < SUBSAMPLE_MAX_STEPS && run.subsample; j++) {
+        run.subsample_z[j] = normal_quantile_upper(
+            ldexp(opts->subsample_eps, -(int) j - 2)
+        );
+    }
+    if ((errno = pthread_mutex_init(&run.mutex, NULL)) != 0)
+        goto error;
+    mutex = true;
+    /*
+     * Arguments of factorials in the log-likelihood are at most N + S,
+     * so they are looked up in a table. Larger numbers of segments than
+     * the table covers fall back to lgamma.
+     */
+    run.nlfact = run.W + (opts->max_segments ? opts->max_segments : 1024) + 1;
+    run.lfact = new_log_factorial_table(run.nlfact);
+    if (run.lfact == NULL)
+        goto error;
+    if (opts->quantize) {
+        run.quantized = quantize(ds, N, param_def, K);
+        if (run.quantized == NULL)
+            goto error;
+    }
+    /*
+     * In low dimensions, populations of proposed segments are looked up
+     * in a summed-area table if it fits the budget. The table counts
+     * elements, not weights.
+     */
+    if (opts->sat_budget > 0 && opts->weights == NULL) {
+        run.sat = new_sat(ds, N, param_def, K, opts->sat_budget);
+        if (run.sat == NULL && errno != ENOTSUP)
+            goto error;
+    }
+    /*
+     * Elements are routed by tc_segments and tc_log_likelihood of trees
+     * passed to the callback, and for diagnostics, on threads kept
+     * for the whole run.
+     */
+    if (opts->route_nthreads != 1) {
+        run.route_pool = pool_new(opts->route_nthreads);
+        if (run.route_pool == NULL)
+            goto error;
+    }
 
-    tree = tc_new_tree(10000024, param_def, K);
-    if (tree == NULL) {
+    run.nchains = MAX(opts->nchains, 1);
+    run.ntemps = MAX(opts->ntemps, 1);
+    run.nreplicas = run.nchains*run.ntemps;
+    run.chains = calloc(run.nreplicas, sizeof(struct chain));
+    if (run.chains == NULL) {
         errno = ENOMEM;
         goto error;
     }
+    /*
+     * Every replica draws from its own stream, jumped from the seed
+     * by the replica number, so that results do not depend on the number
+     * of threads.
+     */
+    rng_seed(&rng, opts->seed);
+    for (j = 0; j < run.nreplicas; j++) {
+        if (init_chain(&run, &run.chains[j], j, &rng) != 0)
+            goto error;
+        rng_jump(&rng);
+    }
 
-    /* DEBUG: Create a dummy node. */
-    // node = tc_new_node(tree, 0, 2, (double[]) { 2 });
-    // tc_replace_node(tree->root, node);
-    // node = NULL;
-
-    // tc_dump_tree_simple(tree, NULL);
-
-    l = tc_log_likelihood(tree, ds, N);
-    // tc_dump_segments_json(tree);
-
-    // cb(tree, l, ds, N, cb_data);
-    // tc_dump_tree_simple(tree, NULL);
-
-    niter = 0;
-    nsamples = 0;
-    while (
-        nsamples < opts->nsamples &&
-        (opts->maxiter == 0 || niter < opts->maxiter)
-    ) {
-        assert(check_tree(tree));
-        niter++;
-
-        // tc_dump_tree_simple(tree, NULL);
-
-        action = sample(3, (double[]){
-            opts->move_p,
-            opts->split_p,
-            opts->merge_p
-        });
-
-        switch (action) {
-        case SPLIT:
-            S = count_segments(tree);
-            if (opts->max_segments && S >= opts->max_segments)
-                continue;
-            s = sample(S, NULL);
-            node = select_segment(tree, s);
-            k = sample(K, NULL);
-            parent = node->parent;
-
-            pd = &param_def[k];
-            node_range(node, k, &range);
-            if (range.max - range.min <= pd->fragment_size)
-                continue; /* Nowhere to split. */
-            cut = (range.min + pd->fragment_size) +
-                frand1()*(range.max - (range.min + pd->fragment_size));
-            if (pd->fragment_size > 0)
-                cut -= fmod(cut, pd->fragment_size);
-            free_range(&range);
-
-            if (parent != NULL && k == parent->param) {
-                i = find_child(parent, node);
-                cuts = array_insert(
-                    parent->cuts,
-                    parent->ncuts,
-                    &cut,
-                    i,
-                    sizeof(cut)
-                );
-                if (cuts == NULL) {
-                    errno = ENOMEM;
-                    goto error;
-                }
-                new_node = tc_new_node(
-                    tree,
-                    parent->param,
-                    parent->nchildren + 1,
-                    cuts
-                );
-                free(cuts);
-                cuts = NULL;
-                if (new_node == NULL) {
-                    errno = ENOMEM;
-                    goto error;
-                }
-                tc_replace_node(parent, new_node);
-                old_node = parent;
-                for (j = 0; j < i; j++)
-                    tc_replace_node(new_node->children[j], parent->children[j]);
-                for (j = i; j < node->nchildren; j++)
-                    tc_replace_node(new_node->children[j+1], parent->children[j]);
-                assert(check_tree(tree));
-            } else {
-                new_node = tc_new_node(tree, k, 2, (double[]){ cut });
-                if (new_node == NULL) {
-                    errno = ENOMEM;
-                    goto error;
-                }
-                tc_replace_node(node, new_node);
-                old_node = node;
-                assert(check_tree(tree));
-            }
-
-            lx = tc_log_likelihood(tree, ds, N);
-            p = fmin(1, exp(lx - l));
-            accept = sample(2, (double[]){1-p, p});
-            if (accept) {
-                // debug("SPLIT\n");
-                l = lx;
-                nsamples++;
-                res = cb(tree, l, ds, N, cb_data);
-                if (!res) goto cleanup;
-            } else {
-                tc_replace_node(new_node, old_node);
-                for (i = 0; i < old_node->nchildren; i++)
-                    old_node->children[i]->parent = old_node;
-                assert(check_tree(tree));
-                // tree_free_node(new_node);
+    /*
+     * Replicas share the dataset and run on a pool of threads. With
+     * tempering, they run in rounds separated by exchanges.
+     */
+    nthreads = opts->nthreads != 0 ? opts->nthreads : pool_default_nthreads();
+    pool = pool_new(MIN(nthreads, run.nreplicas));
+    if (pool == NULL)
+        goto error;
+    do {
+        pool_run(pool, run_chain, &run, run.nreplicas);
+        for (j = 0; j < run.nreplicas; j++) {
+            if (run.chains[j].err != 0) {
+                errno = run.chains[j].err;
+                goto error;
             }
-            break;
-        case MERGE:
-            SS = count_supersegments(tree);
-            if (SS == 0) continue;
-            ss = sample(SS, NULL);
-            node = select_supersegment(tree, ss);
-            pd = &tree->param_def[node->param];
-            if (pd->type == TC_METRIC) {
-                C = count_movable_cuts(node);
-                c = sample(C, NULL);
-                i = select_movable_cut(node, c);
-                cuts = array_remove(node->cuts, node->ncuts, i, sizeof(cut));
-                if (cuts == NULL) {
-                    errno = ENOMEM;
-                    goto error;
-                }
-                new_node = tc_new_node(
-                    tree,
-                    node->nchildren > 2 ? node->param : 0,
-                    node->nchildren > 2 ? node->nchildren - 1 : 0,
-                    cuts
-                );
-                if (new_node == NULL) {
-                    errno = ENOMEM;
-                    goto error;
-                }
-                free(cuts);
-                cuts = NULL;
-                tc_replace_node(node, new_node);
-                old_node = node;
-                for (j = 0; j < new_node->nchildren; j++) {
-                    tc_replace_node(
-                        new_node->children[i],
-                        node->children[j < i ? j : j + 1]
-                    );
-                }
-                lx = tc_log_likelihood(tree, ds, N);
-                p = fmin(1, exp(lx - l));
-                accept = sample(2, (double[]){1-p, p});
-                // tc_dump_tree_simple(tree, NULL);
-                // debug("l = %lf, lx = %lf, p = %lf\n", l, lx, p);
-                if (accept) {
-                    // debug("MERGE\n");
-                    l = lx;
-                    nsamples++;
-                    res = cb(tree, l, ds, N, cb_data);
-                    if (!res) goto cleanup;
-                } else {
-                    tc_replace_node(new_node, old_node);
-                    for (j = 0; j < node->nchildren; j++)
-                        old_node->children[j]->parent = old_node;
-                    // tree_free_node(new_node);
-                }
-            } else if (pd->type == TC_NOMINAL) {
-                /* Not implemented. */
-            } else assert(0);
-            break;
-        case MOVE:
-            SS = count_supersegments(tree);
-            if (SS == 0) continue;
-            // debug("SS = %zu\n", SS);
-            ss = sample(SS, NULL);
-            node = select_supersegment(tree, ss);
-            pd = &param_def[node->param];
-            if (pd->type == TC_METRIC) {
-                C = count_movable_cuts(node);
-                c = sample(C, NULL);
-                i = select_movable_cut(node, c);
-                cut = node->cuts[i];
-                node_range(node->children[i], node->param, &range);
-                w1 = range.max - range.min;
-                free_range(&range);
-                node_range(node->children[i+1], node->param, &range);
-                w2 = range.max - range.min;
-                free_range(&range);
-
-                if (w1 <= pd->fragment_size && w2 <= pd->fragment_size)
-                    continue; /* Nowhere to move. */
-
-                // debug("w1 = %lf, w2 = %lf\n", w1, w2);
-                new_cut = rtnorm(0, (w1 + w2)*opts->move_sd_frac, -w1, w2);
-                if (pd->fragment_size > 0)
-                    new_cut -= fmod(new_cut, pd->fragment_size);
-                if (new_cut == 0) continue;
-                node->cuts[i] = cut + new_cut;
-                lx = tc_log_likelihood(tree, ds, N);
-                p = fmin(1, exp(lx - l));
-                accept = sample(2, (double[]){1-p, p});
-                if (accept) {
-                    // debug("MOVE\n");
-                    l = lx;
-                    nsamples++;
-                    res = cb(tree, l, ds, N, cb_data);
-                    if (!res) goto cleanup;
-                } else {
-                    node->cuts[i] = cut;
-                }
-            } else if (pd->type == TC_NOMINAL) {
-                /* Not implemented. */
-            } else assert(0);
-            break;
-        default: assert(0);
         }
-    }
+        res = run.ntemps > 1 ? exchange(&run) : 0;
+        if (res < 0)
+            goto error;
+    } while (res > 0);
+    pool_free(pool);
+    pool = NULL;
+    if (opts->diagnostics != NULL && diagnose(&run, opts->diagnostics) != 0)
+        goto error;
 
-    debug("accept ratio = %.2lf%%\n", 100.0*nsamples/niter);
-cleanup:
     errno = 0;
 error:
-    if (cuts != NULL) free(cuts);
-    if (tree != NULL) free(tree);
-    deinit_gsl();
+    if (pool != NULL) pool_free(pool);
+    if (run.chains != NULL) {
+        for (j = 0; j < run.nreplicas; j++)
+            free_chain(&run.chains[j]);
+        free(run.chains);
+    }
+    if (run.lfact != NULL) free(run.lfact);
+    free_quantized(run.quantized);
+    free_sat(run.sat);
+    pool_free(run.route_pool);
+    if (mutex) pthread_mutex_destroy(&run.mutex);
     muntrace();
     return errno != 0 ? -1 : 0;
 }
@@ -0,0 +1,213 @@
+/*
+ * tc_compile.c
+ *
+ * tc_compile_tree implementation.
+ *
+ * A compiled tree stores nodes in breadth-first order as a structure
+ * of arrays. Children of a node are consecutive, so that a child is found
+ * by adding its index to the first child of the node, and no pointers
+ * are chased while routing an element.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+
+#include "misc.h"
+#include "tree.h"
+#include "search.h"
+#include "tc.h"
+
+/* Number of elements routed together by tc_compiled_segments. */
+#define BLOCK_SIZE 64
+
+struct tc_compiled_tree *
+tc_compile_tree(const struct tc_tree *tree)
+{
+    size_t i = 0, j = 0, head = 0, tail = 0;
+    size_t nnodes = 0, S = 0, ncuts = 0, ncategories = 0;
+    const struct tc_node *node = NULL;
+    const struct tc_node **queue = NULL;
+    struct tc_compiled_tree *ct = NULL;
+    struct tc_range range;
+    uint32_t *u = NULL;
+    double *d = NULL;
+
+    for (node = tree->first; node != NULL; node = node->next) {
+        nnodes++;
+        if (is_segment(node))
+            S++;
+        else if (tree->param_def[node->param].type == TC_METRIC)
+            ncuts += node->ncuts;
+        else
+            ncategories += node->ncategories;
+    }
+    if (nnodes > UINT32_MAX || ncuts + ncategories > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ct = calloc(1, sizeof(struct tc_compiled_tree));
+    queue = calloc(nnodes, sizeof(struct tc_node *));
+    u = calloc(4*nnodes + ncategories, sizeof(uint32_t));
+    d = calloc(2*nnodes + ncuts, sizeof(double));
+    if (ct == NULL || queue == NULL || u == NULL || d == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    ct->param_def = tree->param_def;
+    ct->K = tree->K;
+    ct->nnodes = nnodes;
+    ct->S = S;
+    ct->param = u;
+    ct->nchildren = u + nnodes;
+    ct->child = u + 2*nnodes;
+    ct->off = u + 3*nnodes;
+    ct->categories = u + 4*nnodes;
+    ct->min = d;
+    ct->max = d + nnodes;
+    ct->cuts = d + 2*nnodes;
+
+    ncuts = 0;
+    ncategories = 0;
+    queue[tail++] = tree->root;
+    for (head = 0; head < tail; head++) {
+        i = head;
+        node = queue[i];
+        ct->param[i] = node->param;
+        ct->nchildren[i] = node->nchildren;
+        if (is_segment(node)) {
+            /* Segments are numbered by index in the segment set. */
+            ct->child[i] = node->index;
+            continue;
+        }
+        ct->child[i] = tail;
+        for (j = 0; j < node->nchildren; j++)
+            queue[tail++] = node->children[j];
+        if (IS_METRIC(node)) {
+            node_range(node, node->param, &range);
+            ct->min[i] = range.min;
+            ct->max[i] = range.max;
+            free_range(&range);
+            ct->off[i] = ncuts;
+            for (j = 0; j < node->ncuts; j++)
+                ct->cuts[ncuts++] = node->cuts[j];
+        } else if (IS_NOMINAL(node)) {
+            ct->off[i] = ncategories;
+            ct->min[i] = PD(node)->min.int64;
+            ct->max[i] = node->ncategories;
+            for (j = 0; j < node->ncategories; j++)
+                ct->categories[ncategories++] = node->categories[j];
+        } else assert(0);
+    }
+    assert(tail == nnodes);
+
+    free(queue);
+    return ct;
+error:
+    if (ct != NULL) free(ct);
+    if (queue != NULL) free(queue);
+    if (u != NULL) free(u);
+    if (d != NULL) free(d);
+    return NULL;
+}
+
+/*
+ * Return the child of internal node `i` at depth `depth` of compiled tree `ct`
+ * to which element `n` belongs.
+ */
+static inline uint32_t
+route(
+    const struct tc_compiled_tree *ct,
+    const void *ds[],
+    size_t n,
+    uint32_t i,
+    uint32_t depth
+) {
+    int64_t v = 0;
+    double x = 0;
+
+    if (ct->param_def[ct->param[i]].type == TC_METRIC) {
+        x = ((const double *) ds[ct->param[i]])[n];
+        if (isnan(x)) {
+            /*
+             * Assign element to a child pseudorandomly according
+             * to the width of children.
+             */
+            x = ct->min[i] + hrand(n, depth)*(ct->max[i] - ct->min[i]);
+        }
+        return ct->child[i] +
+            search_cuts(&ct->cuts[ct->off[i]], ct->nchildren[i] - 1, x);
+    }
+    v = ((const int64_t *) ds[ct->param[i]])[n] - (int64_t) ct->min[i];
+    if (v >= 0 && v < (int64_t) ct->max[i])
+        return ct->child[i] + ct->categories[ct->off[i] + v];
+    /* Assign unknown category to a child pseudorandomly. */
+    return ct->child[i] + (uint32_t) (hrand(n, depth)*ct->nchildren[i]);
+}
+
+size_t
+tc_compiled_segment(
+    const struct tc_compiled_tree *ct,
+    const void *ds[],
+    size_t n
+) {
+    uint32_t i = 0, depth = 0;
+    while (ct->nchildren[i] != 0)
+        i = route(ct, ds, n, i, depth++);
+    return ct->child[i];
+}
+
+/*
+ * Elements are routed in blocks, advancing every element of the block
+ * by one level in turn. Descents of different elements do not depend
+ * on each other, so their memory accesses overlap instead of waiting
+ * for the previous level of a single element.
+ */
+void
+tc_compiled_segments(
+    const struct tc_compiled_tree *ct,
+    const void *ds[],
+    size_t off,
+    size_t N,
+    uint32_t *segment_ids
+) {
+    size_t n = 0, j = 0, m = 0, nactive = 0;
+    uint32_t depth = 0;
+    uint32_t node[BLOCK_SIZE];
+    size_t elements[BLOCK_SIZE];
+
+    for (n = 0; n < N; n += BLOCK_SIZE) {
+        nactive = MIN(BLOCK_SIZE, N - n);
+        for (j = 0; j < nactive; j++) {
+            node[j] = 0;
+            elements[j] = j;
+        }
+        for (depth = 0; nactive > 0; depth++) {
+            m = 0;
+            for (j = 0; j < nactive; j++) {
+                if (ct->nchildren[node[j]] == 0) {
+                    segment_ids[n + elements[j]] = ct->child[node[j]];
+                    continue;
+                }
+                node[m] = route(ct, ds, off + n + elements[j], node[j], depth);
+                elements[m] = elements[j];
+                m++;
+            }
+            nactive = m;
+        }
+    }
+}
+
+void
+tc_free_compiled_tree(struct tc_compiled_tree *ct)
+{
+    if (ct == NULL) return;
+    free(ct->param);
+    free(ct->min);
+    free(ct);
+}
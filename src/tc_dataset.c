@@ -0,0 +1,234 @@
+/*
+ * tc_dataset.c
+ *
+ * Binary columnar dataset files.
+ *
+ * A dataset file consists of a header, a descriptor of every parameter,
+ * and a block of values of every parameter. Blocks start at offsets
+ * aligned to DATASET_ALIGN bytes, so that they can be passed to tc_clustering
+ * directly from a memory mapping of the file. Values are stored in the byte
+ * order of the host which wrote the file. See README.md for the layout.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tc.h"
+
+/* Alignment of column blocks in bytes. */
+#define DATASET_ALIGN 64
+
+#define DATASET_MAGIC "TCDS"
+#define DATASET_VERSION 1
+#define DATASET_BOM 0x01020304
+
+struct header {
+    char magic[4]; /* DATASET_MAGIC. */
+    uint32_t version; /* DATASET_VERSION. */
+    uint32_t bom; /* DATASET_BOM in the byte order of the file. */
+    uint32_t reserved;
+    uint64_t K; /* Number of parameters. */
+    uint64_t N; /* Number of elements. */
+};
+
+struct column {
+    uint32_t type; /* enum tc_param_type. */
+    uint32_t size; /* enum tc_param_size. */
+    union tc_value min; /* Minimum parameter value. */
+    union tc_value max; /* Maximum parameter value. */
+    double fragment_size; /* Fragment size. */
+    uint64_t offset; /* Offset of the block of values from start of file. */
+};
+
+/*
+ * Return `off` rounded up to a multiple of DATASET_ALIGN.
+ */
+static uint64_t
+align(uint64_t off)
+{
+    return (off + DATASET_ALIGN - 1)/DATASET_ALIGN*DATASET_ALIGN;
+}
+
+/*
+ * Check column `col` of a dataset file of `size` bytes with `N` elements.
+ * Returns 0 if correct, -1 if incorrect.
+ */
+static int
+check_column(const struct column *col, uint64_t N, uint64_t size)
+{
+    if (col->type != TC_METRIC && col->type != TC_NOMINAL)
+        return -1;
+    if (col->size != TC_FLOAT64 && col->size != TC_INT64)
+        return -1;
+    if (col->offset % DATASET_ALIGN != 0 || col->offset > size)
+        return -1;
+    if (N > (size - col->offset)/TC_SIZE[col->size])
+        return -1;
+    return 0;
+}
+
+struct tc_dataset *
+tc_dataset_open(const char *filename)
+{
+    size_t k = 0;
+    int fd = -1;
+    int errsv = 0;
+    struct stat st;
+    const struct header *header = NULL;
+    const struct column *columns = NULL;
+    struct tc_dataset *dataset = NULL;
+
+    dataset = calloc(1, sizeof(struct tc_dataset));
+    if (dataset == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    dataset->map = MAP_FAILED;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0)
+        goto error;
+    if ((uint64_t) st.st_size < sizeof(struct header)) {
+        errno = EINVAL;
+        goto error;
+    }
+    dataset->size = st.st_size;
+    dataset->map = mmap(NULL, dataset->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (dataset->map == MAP_FAILED)
+        goto error;
+    close(fd);
+    fd = -1;
+
+    header = dataset->map;
+    if (memcmp(header->magic, DATASET_MAGIC, 4) != 0 ||
+        header->version != DATASET_VERSION ||
+        header->bom != DATASET_BOM ||
+        header->K > (dataset->size - sizeof(struct header))/
+            sizeof(struct column)) {
+        errno = EINVAL;
+        goto error;
+    }
+    dataset->K = header->K;
+    dataset->N = header->N;
+    columns = (const struct column *) (header + 1);
+
+    dataset->param_def = calloc(
+        dataset->K > 0 ? dataset->K : 1,
+        sizeof(struct tc_param_def)
+    );
+    dataset->ds = calloc(dataset->K > 0 ? dataset->K : 1, sizeof(void *));
+    if (dataset->param_def == NULL || dataset->ds == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+    for (k = 0; k < dataset->K; k++) {
+        if (check_column(&columns[k], dataset->N, dataset->size) != 0) {
+            errno = EINVAL;
+            goto error;
+        }
+        dataset->param_def[k].type = columns[k].type;
+        dataset->param_def[k].size = columns[k].size;
+        dataset->param_def[k].min = columns[k].min;
+        dataset->param_def[k].max = columns[k].max;
+        dataset->param_def[k].fragment_size = columns[k].fragment_size;
+        dataset->ds[k] = (const uint8_t *) dataset->map + columns[k].offset;
+    }
+    return dataset;
+error:
+    errsv = errno;
+    if (fd != -1) close(fd);
+    tc_dataset_close(dataset);
+    errno = errsv;
+    return NULL;
+}
+
+void
+tc_dataset_close(struct tc_dataset *dataset)
+{
+    if (dataset == NULL) return;
+    if (dataset->map != MAP_FAILED && dataset->map != NULL)
+        munmap(dataset->map, dataset->size);
+    free(dataset->param_def);
+    free(dataset->ds);
+    free(dataset);
+}
+
+int
+tc_dataset_write(
+    const char *filename,
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+) {
+    size_t k = 0;
+    uint64_t off = 0;
+    int errsv = 0;
+    FILE *fp = NULL;
+    struct header header;
+    struct column column;
+    static const uint8_t zeros[DATASET_ALIGN];
+
+    for (k = 0; k < K; k++) {
+        if (param_def[k].size != TC_FLOAT64 &&
+            param_def[k].size != TC_INT64) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL)
+        return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, 4);
+    header.version = DATASET_VERSION;
+    header.bom = DATASET_BOM;
+    header.K = K;
+    header.N = N;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        goto error;
+
+    off = align(sizeof(struct header) + K*sizeof(struct column));
+    for (k = 0; k < K; k++) {
+        memset(&column, 0, sizeof(column));
+        column.type = param_def[k].type;
+        column.size = param_def[k].size;
+        column.min = param_def[k].min;
+        column.max = param_def[k].max;
+        column.fragment_size = param_def[k].fragment_size;
+        column.offset = off;
+        if (fwrite(&column, sizeof(column), 1, fp) != 1)
+            goto error;
+        off = align(off + N*TC_SIZE[param_def[k].size]);
+    }
+
+    for (k = 0; k < K; k++) {
+        off = ftell(fp);
+        if (fwrite(zeros, 1, align(off) - off, fp) != align(off) - off)
+            goto error;
+        if (fwrite(ds[k], TC_SIZE[param_def[k].size], N, fp) != N)
+            goto error;
+    }
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto error;
+    }
+    return 0;
+error:
+    errsv = errno;
+    if (fp != NULL) fclose(fp);
+    errno = errsv != 0 ? errsv : EIO;
+    return -1;
+}
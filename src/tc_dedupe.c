@@ -0,0 +1,204 @@
+/*
+ * tc_dedupe.c
+ *
+ * Deduplication of elements into weighted unique rows.
+ *
+ * Elements are hashed by a key of every parameter: the fragment index
+ * of metric parameters with a non-zero fragment size, the value of other
+ * metric parameters, and the category of nominal parameters. Since cuts
+ * of such parameters lie on the grid of fragments, elements with equal
+ * keys fall into the same segment of every tree the sampler generates,
+ * and can be replaced by a single row whose weight is their number.
+ * Elements with a missing or infinite value are never merged, as elements
+ * with a missing value are assigned to segments individually.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "quantize.h"
+#include "tc.h"
+
+/*
+ * Return the key of element `n` of parameter `pd` with values `data`.
+ */
+static uint64_t
+key(const struct tc_param_def *pd, const void *data, size_t n)
+{
+    double x = 0;
+    uint64_t u = 0;
+
+    if (pd->type == TC_NOMINAL)
+        return ((const int64_t *) data)[n];
+    x = ((const double *) data)[n];
+    if (pd->fragment_size > 0)
+        return value_index(pd, x);
+    if (x == 0)
+        x = 0; /* Same key for -0. */
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+/*
+ * Returns true if element `n` of dataset `ds` has a missing or infinite
+ * value of a metric parameter.
+ */
+static bool
+is_unique(
+    const void *ds[],
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t n
+) {
+    size_t k = 0;
+    for (k = 0; k < K; k++) {
+        if (param_def[k].type == TC_METRIC &&
+            !isfinite(((const double *) ds[k])[n]))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Return the hash of the keys of element `n` of dataset `ds`.
+ */
+static uint64_t
+hash(
+    const void *ds[],
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t n
+) {
+    size_t k = 0;
+    uint64_t h = K;
+    for (k = 0; k < K; k++) {
+        h = (h ^ key(&param_def[k], ds[k], n))*UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/*
+ * Returns true if elements `m` and `n` of dataset `ds` have equal keys.
+ */
+static bool
+equal(
+    const void *ds[],
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t m,
+    size_t n
+) {
+    size_t k = 0;
+    for (k = 0; k < K; k++) {
+        if (key(&param_def[k], ds[k], m) != key(&param_def[k], ds[k], n))
+            return false;
+    }
+    return true;
+}
+
+struct tc_deduped *
+tc_dedupe(
+    const void *ds[],
+    size_t N,
+    const struct tc_param_def param_def[],
+    size_t K
+) {
+    size_t n = 0, k = 0, u = 0, h = 0, size = 1;
+    size_t *first = NULL; /* Element of every unique row. */
+    size_t *table = NULL; /* Unique row plus 1 by hash, or 0. */
+    uint32_t *weights = NULL;
+    struct tc_deduped *deduped = NULL;
+
+    deduped = calloc(1, sizeof(struct tc_deduped));
+    if (deduped == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    deduped->K = K;
+    while (size < 2*N)
+        size *= 2;
+    first = calloc(N > 0 ? N : 1, sizeof(size_t));
+    table = calloc(size, sizeof(size_t));
+    deduped->ds = calloc(K > 0 ? K : 1, sizeof(void *));
+    deduped->weights = calloc(N > 0 ? N : 1, sizeof(uint32_t));
+    deduped->index = calloc(N > 0 ? N : 1, sizeof(size_t));
+    if (first == NULL || table == NULL || deduped->ds == NULL ||
+        deduped->weights == NULL || deduped->index == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    /*
+     * Open addressing with linear probing. A row which reached
+     * the maximum weight is replaced in the table by a new row.
+     */
+    for (n = 0; n < N; n++) {
+        if (is_unique(ds, param_def, K, n)) {
+            u = deduped->N++;
+        } else {
+            h = hash(ds, param_def, K, n) & (size - 1);
+            while (table[h] != 0 &&
+                   !equal(ds, param_def, K, first[table[h] - 1], n))
+                h = (h + 1) & (size - 1);
+            if (table[h] != 0 &&
+                deduped->weights[table[h] - 1] < UINT32_MAX) {
+                u = table[h] - 1;
+            } else {
+                u = deduped->N++;
+                table[h] = u + 1;
+            }
+        }
+        if (deduped->weights[u]++ == 0)
+            first[u] = n;
+        deduped->index[n] = u;
+    }
+
+    weights = realloc(deduped->weights, MAX(deduped->N, 1)*sizeof(uint32_t));
+    if (weights != NULL)
+        deduped->weights = weights;
+
+    for (k = 0; k < K; k++) {
+        deduped->ds[k] = calloc(deduped->N > 0 ? deduped->N : 1, 8);
+        if (deduped->ds[k] == NULL) {
+            errno = ENOMEM;
+            goto error;
+        }
+        for (u = 0; u < deduped->N; u++) {
+            memcpy(
+                (uint8_t *) deduped->ds[k] + 8*u,
+                (const uint8_t *) ds[k] + 8*first[u],
+                8
+            );
+        }
+    }
+    free(first);
+    free(table);
+    return deduped;
+error:
+    free(first);
+    free(table);
+    tc_deduped_free(deduped);
+    return NULL;
+}
+
+void
+tc_deduped_free(struct tc_deduped *deduped)
+{
+    size_t k = 0;
+    if (deduped == NULL) return;
+    if (deduped->ds != NULL) {
+        for (k = 0; k < deduped->K; k++)
+            free((void *) deduped->ds[k]);
+    }
+    free(deduped->ds);
+    free(deduped->weights);
+    free(deduped->index);
+    free(deduped);
+}
@@ -0,0 +1,944 @@
+/*
+ * tc_log.c
+ *
+ * Binary sample log.
+ *
+ * The log consists of a header, a descriptor of every parameter, and
+ * a record of every sample. A record holds either a snapshot of the tree
+ * (nodes in preorder), or deltas from the previous sample of the same chain:
+ * the proposals accepted in between, with nodes referred to by their index
+ * in preorder. A chain logs a snapshot every `interval` samples, after
+ * an exchange of trees in parallel tempering, and whenever the deltas would
+ * take more space than the snapshot. Values are stored in the byte order
+ * of the host which wrote the file. See README.md for the layout.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "tree.h"
+#include "log.h"
+#include "tc.h"
+
+#define LOG_MAGIC "TCSL"
+#define LOG_VERSION 1
+#define LOG_BOM 0x01020304
+
+#define NONE ((size_t) -1)
+
+/* Alignment of records in bytes. */
+#define LOG_ALIGN 8
+
+/* Initial size of trees reconstructed by readers in bytes. */
+#define LOG_TREE_SIZE (1 << 20)
+
+/* Maximum size of deltas of a chain between samples in bytes. */
+#define LOG_MAX_DELTAS (1 << 20)
+
+enum record_kind { SNAPSHOT = 1, DELTAS = 2 };
+
+enum delta_action { LOG_SPLIT = 1, LOG_MERGE = 2, LOG_MOVE = 3 };
+
+struct header {
+    char magic[4]; /* LOG_MAGIC. */
+    uint32_t version; /* LOG_VERSION. */
+    uint32_t bom; /* LOG_BOM in the byte order of the file. */
+    uint32_t reserved;
+    uint64_t K; /* Number of parameters. */
+    uint64_t interval; /* Number of samples between snapshots. */
+};
+
+struct column {
+    uint32_t type; /* enum tc_param_type. */
+    uint32_t size; /* enum tc_param_size. */
+    union tc_value min; /* Minimum parameter value. */
+    union tc_value max; /* Maximum parameter value. */
+    double fragment_size; /* Fragment size. */
+};
+
+struct record {
+    uint32_t kind; /* enum record_kind. */
+    uint32_t chain; /* Chain which generated the sample. */
+    uint64_t n; /* Number of nodes or deltas. */
+    uint64_t size; /* Size of the payload in bytes (excl. padding). */
+    double l; /* Log-likelihood. */
+};
+
+struct node_record {
+    uint32_t param; /* Parameter. */
+    uint32_t nchildren; /* Number of children (0 for a segment). */
+    /* Followed by nchildren - 1 cuts (double) or categories (uint32_t). */
+};
+
+struct delta {
+    uint32_t action; /* enum delta_action. */
+    uint32_t node; /* Preorder index of the node before the proposal. */
+    uint32_t arg; /* Parameter (split) or cut (merge, move). */
+    uint32_t category; /* Moved category (move of a nominal node). */
+    double cut; /* New cut (split or move of a metric node). */
+    /* Split of a nominal node is followed by a bitset of categories
+       of the second child. */
+};
+
+struct tc_log {
+    FILE *fp; /* Log file. */
+    struct tc_param_def *param_def; /* Parameter definitions. */
+    size_t K; /* Number of parameters. */
+    size_t interval; /* Number of samples between snapshots. */
+};
+
+/*
+ * Location of a sample in the log file.
+ */
+struct entry {
+    const struct record *record; /* Record of the sample. */
+    size_t prev; /* Previous sample of the chain, or -1. */
+    size_t base; /* Last snapshot of the chain up to the sample. */
+};
+
+/*
+ * Return `size` rounded up to a multiple of LOG_ALIGN.
+ */
+static uint64_t
+align(uint64_t size)
+{
+    return (size + LOG_ALIGN - 1)/LOG_ALIGN*LOG_ALIGN;
+}
+
+/*
+ * Find the preorder index of node `target` in the subtree of `node`,
+ * starting at `*j`. Returns true if found.
+ */
+static bool
+preorder_index(
+    const struct tc_node *node,
+    const struct tc_node *target,
+    size_t *j
+) {
+    size_t i = 0;
+    if (node == target)
+        return true;
+    (*j)++;
+    for (i = 0; i < node->nchildren; i++) {
+        if (preorder_index(node->children[i], target, j))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Return the node at preorder index `*j` of the subtree of `node`,
+ * or NULL if the subtree is smaller (with `*j` decreased by its size).
+ */
+static struct tc_node *
+preorder_node(struct tc_node *node, size_t *j)
+{
+    size_t i = 0;
+    struct tc_node *found = NULL;
+    if (*j == 0)
+        return node;
+    (*j)--;
+    for (i = 0; i < node->nchildren; i++) {
+        found = preorder_node(node->children[i], j);
+        if (found != NULL)
+            return found;
+    }
+    return NULL;
+}
+
+/*
+ * Return the size of the record of node `node` in bytes.
+ */
+static size_t
+node_record_size(const struct tc_node *node)
+{
+    if (is_segment(node))
+        return sizeof(struct node_record);
+    if (IS_METRIC(node))
+        return sizeof(struct node_record) + node->ncuts*sizeof(double);
+    return sizeof(struct node_record) + node->ncategories*sizeof(uint32_t);
+}
+
+/*
+ * Add the number of nodes of the subtree of `node` to `*n`, and the size
+ * of their records to `*size`.
+ */
+static void
+subtree_size(const struct tc_node *node, size_t *n, size_t *size)
+{
+    size_t i = 0;
+    (*n)++;
+    *size += node_record_size(node);
+    for (i = 0; i < node->nchildren; i++)
+        subtree_size(node->children[i], n, size);
+}
+
+/*
+ * Write records of the subtree of `node` in preorder to `fp`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+write_subtree(FILE *fp, const struct tc_node *node)
+{
+    size_t i = 0, c = 0;
+    uint32_t category = 0;
+    struct node_record rec;
+
+    rec.param = node->param;
+    rec.nchildren = node->nchildren;
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+        return -1;
+    if (is_segment(node)) {
+        return 0;
+    } else if (IS_METRIC(node)) {
+        if (fwrite(node->cuts, sizeof(double), node->ncuts, fp) != node->ncuts)
+            return -1;
+    } else {
+        for (c = 0; c < node->ncategories; c++) {
+            category = node->categories[c];
+            if (fwrite(&category, sizeof(category), 1, fp) != 1)
+                return -1;
+        }
+    }
+    for (i = 0; i < node->nchildren; i++) {
+        if (write_subtree(fp, node->children[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+struct tc_log *
+tc_log_open(
+    const char *filename,
+    const struct tc_param_def param_def[],
+    size_t K,
+    size_t interval
+) {
+    size_t k = 0;
+    int errsv = 0;
+    struct tc_log *log = NULL;
+    struct header header;
+    struct column column;
+
+    log = calloc(1, sizeof(struct tc_log));
+    if (log == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    log->K = K;
+    log->interval = MAX(interval, 1);
+    log->param_def = calloc(K > 0 ? K : 1, sizeof(struct tc_param_def));
+    if (log->param_def == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+    memcpy(log->param_def, param_def, K*sizeof(struct tc_param_def));
+
+    log->fp = fopen(filename, "wb");
+    if (log->fp == NULL)
+        goto error;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, 4);
+    header.version = LOG_VERSION;
+    header.bom = LOG_BOM;
+    header.K = K;
+    header.interval = log->interval;
+    if (fwrite(&header, sizeof(header), 1, log->fp) != 1)
+        goto error;
+    for (k = 0; k < K; k++) {
+        memset(&column, 0, sizeof(column));
+        column.type = param_def[k].type;
+        column.size = param_def[k].size;
+        column.min = param_def[k].min;
+        column.max = param_def[k].max;
+        column.fragment_size = param_def[k].fragment_size;
+        if (fwrite(&column, sizeof(column), 1, log->fp) != 1)
+            goto error;
+    }
+    return log;
+error:
+    errsv = errno;
+    if (log->fp != NULL) fclose(log->fp);
+    free(log->param_def);
+    free(log);
+    errno = errsv != 0 ? errsv : EIO;
+    return NULL;
+}
+
+int
+tc_log_close(struct tc_log *log)
+{
+    int res = 0;
+    if (log == NULL) return 0;
+    if (fclose(log->fp) != 0) {
+        if (errno == 0) errno = EIO;
+        res = -1;
+    }
+    free(log->param_def);
+    free(log);
+    return res;
+}
+
+/*
+ * Returns true if log `log` was opened for parameters `param_def`.
+ */
+bool
+log_matches(
+    const struct tc_log *log,
+    const struct tc_param_def param_def[],
+    size_t K
+) {
+    size_t k = 0;
+    if (log->K != K)
+        return false;
+    for (k = 0; k < K; k++) {
+        if (log->param_def[k].type != param_def[k].type ||
+            log->param_def[k].size != param_def[k].size)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Initialize deltas of a chain `lc`. The first sample is a snapshot.
+ */
+void
+log_chain_init(struct log_chain *lc)
+{
+    memset(lc, 0, sizeof(struct log_chain));
+    lc->snapshot = true;
+}
+
+/*
+ * Free deltas of a chain `lc`.
+ */
+void
+log_chain_free(struct log_chain *lc)
+{
+    free(lc->deltas);
+    lc->deltas = NULL;
+}
+
+/*
+ * Discard deltas of a chain `lc` whose tree was replaced. The next sample
+ * is a snapshot.
+ */
+void
+log_chain_reset(struct log_chain *lc)
+{
+    lc->size = 0;
+    lc->ndeltas = 0;
+    lc->snapshot = true;
+}
+
+/*
+ * Append delta `d` followed by `nextra` bytes of `extra` to deltas of chain
+ * `lc`, with the node of `d` set to the preorder index of `node`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+append_delta(
+    struct log_chain *lc,
+    struct delta *d,
+    const struct tc_node *node,
+    const void *extra,
+    size_t nextra
+) {
+    size_t j = 0, capacity = 0;
+    uint8_t *deltas = NULL;
+
+    /* Long runs of thinned samples are logged as a snapshot instead. */
+    if (lc->size + sizeof(struct delta) + nextra > LOG_MAX_DELTAS) {
+        log_chain_reset(lc);
+        return 0;
+    }
+    preorder_index(node->tree->root, node, &j);
+    d->node = j;
+    if (lc->size + sizeof(struct delta) + nextra > lc->capacity) {
+        capacity = MAX(
+            2*lc->capacity,
+            MAX(lc->size + sizeof(struct delta) + nextra, 1024)
+        );
+        deltas = realloc(lc->deltas, capacity);
+        if (deltas == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        lc->deltas = deltas;
+        lc->capacity = capacity;
+    }
+    memcpy(&lc->deltas[lc->size], d, sizeof(struct delta));
+    lc->size += sizeof(struct delta);
+    if (nextra > 0)
+        memcpy(&lc->deltas[lc->size], extra, nextra);
+    lc->size += nextra;
+    lc->ndeltas++;
+    return 0;
+}
+
+/*
+ * Record an accepted split of segment `node` by cut `cut` in metric
+ * parameter `param`, or by `categories` (child of every category)
+ * in nominal parameter `param`. Must be called before the tree is changed.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+log_split(
+    struct log_chain *lc,
+    const struct tc_node *node,
+    size_t param,
+    double cut,
+    const int64_t *categories
+) {
+    size_t c = 0, C = 0;
+    int res = 0;
+    uint64_t *set = NULL;
+    const struct tc_param_def *pd = &node->tree->param_def[param];
+    struct delta d = { .action = LOG_SPLIT, .arg = param, .cut = cut };
+
+    if (pd->type == TC_METRIC)
+        return append_delta(lc, &d, node, NULL, 0);
+    C = NCATEGORIES(pd);
+    set = calloc(BITSET_WORDS(C), sizeof(uint64_t));
+    if (set == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (c = 0; c < C; c++) {
+        if (categories[c] == 1)
+            BITSET_SET(set, c);
+    }
+    res = append_delta(lc, &d, node, set, BITSET_WORDS(C)*sizeof(uint64_t));
+    free(set);
+    return res;
+}
+
+/*
+ * Record an accepted merge of children `i` and `i + 1` of `node`.
+ * Must be called before the tree is changed. Returns 0 on success,
+ * -1 on failure.
+ */
+int
+log_merge(struct log_chain *lc, const struct tc_node *node, size_t i)
+{
+    struct delta d = { .action = LOG_MERGE, .arg = i };
+    return append_delta(lc, &d, node, NULL, 0);
+}
+
+/*
+ * Record an accepted move of cut `i` of metric node `node` to `cut`,
+ * or of category `c` between children `i` and `i + 1` of nominal node
+ * `node`. Must be called before the tree is changed. Returns 0 on success,
+ * -1 on failure.
+ */
+int
+log_move(
+    struct log_chain *lc,
+    const struct tc_node *node,
+    size_t i,
+    double cut,
+    size_t c
+) {
+    struct delta d = {
+        .action = LOG_MOVE,
+        .arg = i,
+        .category = c,
+        .cut = cut
+    };
+    return append_delta(lc, &d, node, NULL, 0);
+}
+
+/*
+ * Write sample `tree` with log-likelihood `l` of chain `lc` to log `log`,
+ * as a snapshot or as the deltas recorded since the previous sample.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+log_sample(
+    struct tc_log *log,
+    struct log_chain *lc,
+    const struct tc_tree *tree,
+    double l
+) {
+    size_t n = 0, size = 0;
+    struct record rec;
+    static const uint8_t zeros[LOG_ALIGN];
+
+    subtree_size(tree->root, &n, &size);
+    memset(&rec, 0, sizeof(rec));
+    rec.chain = tree->chain;
+    rec.l = l;
+    if (lc->snapshot || lc->nsince >= log->interval || lc->size >= size) {
+        rec.kind = SNAPSHOT;
+        rec.n = n;
+        rec.size = size;
+        if (fwrite(&rec, sizeof(rec), 1, log->fp) != 1 ||
+            write_subtree(log->fp, tree->root) != 0 ||
+            fwrite(zeros, 1, align(size) - size, log->fp) != align(size) - size)
+            goto error;
+        lc->nsince = 1;
+    } else {
+        rec.kind = DELTAS;
+        rec.n = lc->ndeltas;
+        rec.size = lc->size;
+        if (fwrite(&rec, sizeof(rec), 1, log->fp) != 1 ||
+            fwrite(lc->deltas, 1, lc->size, log->fp) != lc->size)
+            goto error;
+        lc->nsince++;
+    }
+    lc->size = 0;
+    lc->ndeltas = 0;
+    lc->snapshot = false;
+    return 0;
+error:
+    if (errno == 0) errno = EIO;
+    return -1;
+}
+
+/*
+ * Read a subtree in preorder from `*p` (ending at `end`) of reader `reader`
+ * in place of segment `leaf`. Returns 0 on success, -1 on failure.
+ */
+static int
+read_subtree(
+    const struct tc_log_reader *reader,
+    struct tc_node *leaf,
+    const uint8_t **p,
+    const uint8_t *end
+) {
+    size_t i = 0, c = 0, C = 0;
+    uint32_t category = 0;
+    int64_t *categories = NULL;
+    void *partitioning = NULL;
+    struct node_record rec;
+    struct tc_node *node = NULL;
+    const struct tc_param_def *pd = NULL;
+
+    if ((size_t) (end - *p) < sizeof(rec))
+        goto invalid;
+    memcpy(&rec, *p, sizeof(rec));
+    *p += sizeof(rec);
+    if (rec.nchildren == 0)
+        return 0;
+    if (rec.param >= reader->K || rec.nchildren < 2)
+        goto invalid;
+    pd = &reader->param_def[rec.param];
+    if (pd->type == TC_METRIC) {
+        if ((size_t) (end - *p)/sizeof(double) < rec.nchildren - 1)
+            goto invalid;
+        partitioning = (void *) *p;
+        *p += (rec.nchildren - 1)*sizeof(double);
+    } else {
+        C = NCATEGORIES(pd);
+        if ((size_t) (end - *p)/sizeof(uint32_t) < C)
+            goto invalid;
+        categories = calloc(C, sizeof(int64_t));
+        if (categories == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (c = 0; c < C; c++) {
+            memcpy(&category, *p, sizeof(category));
+            *p += sizeof(category);
+            if (category >= rec.nchildren) {
+                free(categories);
+                goto invalid;
+            }
+            categories[c] = category;
+        }
+        partitioning = categories;
+    }
+    node = tc_new_node(leaf->tree, rec.param, rec.nchildren, partitioning);
+    free(categories);
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (tc_replace_node(leaf, node) != 0)
+        return -1;
+    tree_free_node(leaf);
+    for (i = 0; i < node->nchildren; i++) {
+        if (read_subtree(reader, node->children[i], p, end) != 0)
+            return -1;
+    }
+    return 0;
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Reconstruct the tree of snapshot `rec` of reader `reader`.
+ * Returns the tree, or NULL on failure.
+ */
+static struct tc_tree *
+read_snapshot(const struct tc_log_reader *reader, const struct record *rec)
+{
+    size_t size = LOG_TREE_SIZE;
+    const uint8_t *p = NULL, *end = NULL;
+    struct tc_tree *tree = NULL;
+
+    for (;;) {
+        tree = tc_new_tree(size, reader->param_def, reader->K);
+        if (tree == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        p = (const uint8_t *) (rec + 1);
+        end = p + rec->size;
+        if (read_subtree(reader, tree->root, &p, end) == 0) {
+            if (p == end)
+                return tree;
+            errno = EINVAL;
+        }
+        free(tree);
+        if (errno != ENOMEM)
+            return NULL;
+        /* Retry with a larger tree buffer. */
+        size *= 2;
+    }
+}
+
+/*
+ * Apply delta at `*p` (ending at `end`) of reader `reader` to `tree`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+apply_delta(
+    const struct tc_log_reader *reader,
+    struct tc_tree *tree,
+    const uint8_t **p,
+    const uint8_t *end
+) {
+    size_t j = 0, c = 0, C = 0;
+    int64_t *categories = NULL;
+    uint64_t word = 0;
+    struct delta d;
+    struct tc_node *node = NULL, *parent = NULL, *new_node = NULL;
+    const struct tc_param_def *pd = NULL;
+
+    if ((size_t) (end - *p) < sizeof(d))
+        goto invalid;
+    memcpy(&d, *p, sizeof(d));
+    *p += sizeof(d);
+    j = d.node;
+    node = preorder_node(tree->root, &j);
+    if (node == NULL)
+        goto invalid;
+
+    switch (d.action) {
+    case LOG_SPLIT:
+        if (!is_segment(node) || d.arg >= reader->K)
+            goto invalid;
+        pd = &reader->param_def[d.arg];
+        parent = node->parent;
+        if (pd->type == TC_METRIC) {
+            if (parent != NULL && parent->param == d.arg)
+                return insert_cut(parent, find_child(parent, node), d.cut);
+            new_node = tc_new_node(tree, d.arg, 2, &d.cut);
+        } else {
+            C = NCATEGORIES(pd);
+            if ((size_t) (end - *p)/sizeof(uint64_t) < BITSET_WORDS(C))
+                goto invalid;
+            categories = calloc(C, sizeof(int64_t));
+            if (categories == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            for (c = 0; c < C; c++) {
+                if (c % 64 == 0) {
+                    memcpy(&word, *p, sizeof(word));
+                    *p += sizeof(word);
+                }
+                categories[c] = (word >> (c % 64)) & 1;
+            }
+            new_node = tc_new_node(tree, d.arg, 2, categories);
+            free(categories);
+        }
+        if (new_node == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (tc_replace_node(node, new_node) != 0)
+            return -1;
+        tree_free_node(node);
+        return 0;
+    case LOG_MERGE:
+        if (d.arg + 1 >= node->nchildren)
+            goto invalid;
+        if (node->nchildren > 2)
+            return remove_cut(node, d.arg);
+        new_node = tc_new_leaf(tree);
+        if (new_node == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (tc_replace_node(node, new_node) != 0)
+            return -1;
+        tree_free_node(node);
+        return 0;
+    case LOG_MOVE:
+        if (d.arg + 1 >= node->nchildren)
+            goto invalid;
+        if (IS_METRIC(node)) {
+            node->cuts[d.arg] = d.cut;
+        } else {
+            if (d.category >= node->ncategories)
+                goto invalid;
+            node->categories[d.category] =
+                node->categories[d.category] == (int64_t) d.arg ?
+                d.arg + 1 : d.arg;
+        }
+        update_boxes(node->children[d.arg]);
+        update_boxes(node->children[d.arg+1]);
+        return 0;
+    }
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Apply deltas of record `rec` of reader `reader` to its tree.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+apply_deltas(struct tc_log_reader *reader, const struct record *rec)
+{
+    size_t n = 0;
+    const uint8_t *p = (const uint8_t *) (rec + 1);
+    const uint8_t *end = p + rec->size;
+
+    for (n = 0; n < rec->n; n++) {
+        if (tree_compact(&reader->tree, LOG_TREE_SIZE) != 0)
+            return -1;
+        if (apply_delta(reader, reader->tree, &p, end) != 0)
+            return -1;
+    }
+    if (p != end) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Index records of reader `reader`, whose file is mapped. Returns 0
+ * on success, -1 on failure.
+ */
+static int
+index_records(struct tc_log_reader *reader, const uint8_t *p)
+{
+    size_t i = 0, size = 0, nchains = 0;
+    size_t *last = NULL, *tmp = NULL;
+    const uint8_t *end = (const uint8_t *) reader->map + reader->size;
+    const struct record *rec = NULL;
+    struct entry *entries = NULL;
+    struct tc_log_sample *samples = NULL;
+
+    for (;;) {
+        if (p == end)
+            break;
+        rec = (const struct record *) p;
+        if ((size_t) (end - p) < sizeof(struct record) ||
+            (rec->kind != SNAPSHOT && rec->kind != DELTAS) ||
+            align(rec->size) > (size_t) (end - p) - sizeof(struct record))
+            goto invalid;
+        if (reader->nsamples == size) {
+            size = MAX(2*size, 1024);
+            entries = realloc(reader->entries, size*sizeof(struct entry));
+            if (entries == NULL) goto nomem;
+            reader->entries = entries;
+            samples = realloc(
+                reader->samples,
+                size*sizeof(struct tc_log_sample)
+            );
+            if (samples == NULL) goto nomem;
+            reader->samples = samples;
+        }
+        if (rec->chain >= nchains) {
+            tmp = realloc(last, (rec->chain + 1)*sizeof(size_t));
+            if (tmp == NULL) goto nomem;
+            last = tmp;
+            for (; nchains <= rec->chain; nchains++)
+                last[nchains] = NONE;
+        }
+        i = reader->nsamples++;
+        entries = reader->entries;
+        entries[i].record = rec;
+        entries[i].prev = last[rec->chain];
+        if (rec->kind == SNAPSHOT) {
+            entries[i].base = i;
+        } else {
+            if (entries[i].prev == NONE)
+                goto invalid;
+            entries[i].base = entries[entries[i].prev].base;
+        }
+        last[rec->chain] = i;
+        reader->samples[i].chain = rec->chain;
+        reader->samples[i].l = rec->l;
+        p += sizeof(struct record) + align(rec->size);
+    }
+    free(last);
+    return 0;
+nomem:
+    free(last);
+    errno = ENOMEM;
+    return -1;
+invalid:
+    free(last);
+    errno = EINVAL;
+    return -1;
+}
+
+struct tc_log_reader *
+tc_log_reader_open(const char *filename)
+{
+    size_t k = 0;
+    int fd = -1;
+    int errsv = 0;
+    struct stat st;
+    const struct header *header = NULL;
+    const struct column *columns = NULL;
+    struct tc_log_reader *reader = NULL;
+
+    reader = calloc(1, sizeof(struct tc_log_reader));
+    if (reader == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    reader->map = MAP_FAILED;
+    reader->current = NONE;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0)
+        goto error;
+    if ((uint64_t) st.st_size < sizeof(struct header)) {
+        errno = EINVAL;
+        goto error;
+    }
+    reader->size = st.st_size;
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (reader->map == MAP_FAILED)
+        goto error;
+    close(fd);
+    fd = -1;
+
+    header = reader->map;
+    if (memcmp(header->magic, LOG_MAGIC, 4) != 0 ||
+        header->version != LOG_VERSION ||
+        header->bom != LOG_BOM ||
+        header->K > (reader->size - sizeof(struct header))/
+            sizeof(struct column)) {
+        errno = EINVAL;
+        goto error;
+    }
+    reader->K = header->K;
+    columns = (const struct column *) (header + 1);
+    reader->param_def = calloc(
+        reader->K > 0 ? reader->K : 1,
+        sizeof(struct tc_param_def)
+    );
+    if (reader->param_def == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+    for (k = 0; k < reader->K; k++) {
+        if ((columns[k].type != TC_METRIC && columns[k].type != TC_NOMINAL) ||
+            (columns[k].size != TC_FLOAT64 && columns[k].size != TC_INT64)) {
+            errno = EINVAL;
+            goto error;
+        }
+        reader->param_def[k].type = columns[k].type;
+        reader->param_def[k].size = columns[k].size;
+        reader->param_def[k].min = columns[k].min;
+        reader->param_def[k].max = columns[k].max;
+        reader->param_def[k].fragment_size = columns[k].fragment_size;
+    }
+    if (index_records(reader, (const uint8_t *) (columns + reader->K)) != 0)
+        goto error;
+    return reader;
+error:
+    errsv = errno;
+    if (fd != -1) close(fd);
+    tc_log_reader_close(reader);
+    errno = errsv;
+    return NULL;
+}
+
+void
+tc_log_reader_close(struct tc_log_reader *reader)
+{
+    if (reader == NULL) return;
+    if (reader->map != MAP_FAILED && reader->map != NULL)
+        munmap(reader->map, reader->size);
+    free(reader->param_def);
+    free(reader->samples);
+    free(reader->entries);
+    free(reader->tree);
+    free(reader);
+}
+
+const struct tc_tree *
+tc_log_read(struct tc_log_reader *reader, size_t i)
+{
+    size_t j = 0, n = 0, m = 0, start = 0;
+    size_t *path = NULL;
+    const struct entry *entries = reader->entries;
+
+    if (i >= reader->nsamples) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /*
+     * Continue from the last sample read if it precedes the sample
+     * in the same chain since the snapshot, or start from the snapshot.
+     */
+    if (reader->current != NONE &&
+        reader->current <= i &&
+        entries[reader->current].base == entries[i].base) {
+        start = reader->current;
+    } else {
+        start = entries[i].base;
+        free(reader->tree);
+        reader->current = NONE;
+        reader->tree = read_snapshot(reader, entries[start].record);
+        if (reader->tree == NULL)
+            return NULL;
+        reader->tree->chain = entries[start].record->chain;
+        reader->current = start;
+    }
+    for (j = i; j != start; j = entries[j].prev)
+        n++;
+    path = calloc(n > 0 ? n : 1, sizeof(size_t));
+    if (path == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    m = n;
+    for (j = i; j != start; j = entries[j].prev)
+        path[--m] = j;
+    for (j = 0; j < n; j++) {
+        if (apply_deltas(reader, entries[path[j]].record) != 0) {
+            /* The tree is in an unknown state. */
+            reader->current = NONE;
+            free(path);
+            return NULL;
+        }
+        reader->current = path[j];
+    }
+    free(path);
+    return reader->tree;
+}
@@ -7,63 +7,159 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
 
 #include "misc.h"
 #include "tree.h"
+#include "elements.h"
+#include "quantize.h"
+#include "sat.h"
 #include "tc.h"
 
+/*
+ * Determine the population of segment `node` from summed-area table `sat`
+ * by the cuts of its ancestors. Returns 0 on success, -1 if a cut is not
+ * on the grid of fragments.
+ */
+static int
+sat_segment_count(
+    const struct tc_sat *sat,
+    const struct tc_node *node,
+    size_t *NX
+) {
+    size_t i = 0, k = 0;
+    size_t lo[SAT_MAX_K], hi[SAT_MAX_K];
+    const struct tc_node *child = NULL, *parent = NULL;
+    const struct tc_param_def *pd = NULL;
+
+    for (k = 0; k < sat->K; k++) {
+        lo[k] = 0;
+        hi[k] = sat->dims[k] - 1;
+    }
+    for (child = node, parent = node->parent;
+         parent != NULL;
+         child = parent, parent = parent->parent) {
+        k = parent->param;
+        pd = &sat->param_def[k];
+        i = find_child(parent, child);
+        if (i > 0) {
+            if (fragment_cut(pd, fragment_index(pd, parent->cuts[i-1])) !=
+                parent->cuts[i-1])
+                return -1;
+            lo[k] = MAX(lo[k], sat_bound(sat, k, parent->cuts[i-1]));
+        }
+        if (i + 1 < parent->nchildren) {
+            if (fragment_cut(pd, fragment_index(pd, parent->cuts[i])) !=
+                parent->cuts[i])
+                return -1;
+            hi[k] = MIN(hi[k], sat_bound(sat, k, parent->cuts[i]));
+        }
+    }
+    *NX = sat_count(sat, lo, hi);
+    return 0;
+}
+
+/*
+ * Calculate the log-likelihood of `tree` from populations of its segments
+ * kept by the sampler, or from its summed-area table, in time independent
+ * of the number of elements. Returns 0 on success, -1 if neither applies.
+ */
+static int
+cached_log_likelihood(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    double *l
+) {
+    size_t S = 0, NX = 0;
+    bool stats = has_stats(tree, ds, N);
+    const struct tc_node *node = NULL;
+
+    if (!stats &&
+        (tree->sat == NULL || tree->sat->ds != ds || tree->sat->N != N))
+        return -1;
+    S = count_segments(tree);
+    /* Trees with a summed-area table are not weighted. */
+    *l = log_likelihood_norm(
+        tree,
+        stats && tree->cumw != NULL ? tree->cumw[N] : N,
+        S
+    );
+    /* The tree is shared with other threads, so nothing is stored in it. */
+    for (node = tree->first; node != NULL; node = node->next) {
+        if (!is_segment(node))
+            continue;
+        if (stats)
+            NX = node_weight(node);
+        else if (sat_segment_count(tree->sat, node, &NX) != 0)
+            return -1;
+        *l += log_factorial(tree, NX);
+        if (NX != 0 && segment_volume(node) != 0)
+            *l -= NX*log(segment_volume(node));
+    }
+    return 0;
+}
+
+/*
+ * Calculate the log-likelihood of `tree` by routing every element of dataset
+ * `ds` of `N` elements through the tree, regardless of populations kept
+ * by the sampler. Returns NaN on failure.
+ */
 double
-tc_log_likelihood(
+routed_log_likelihood(
     const struct tc_tree *tree,
     const void *ds[],
     size_t N
 ) {
-    double l1 = 0, l2 = 0, l = 0; /* Likelihood. */
+    double l = 0; /* Likelihood. */
+    double V = 0;
     size_t s = 0;
-    size_t S = 0; /* Number of segments. */
-    struct tc_segment *segment;
-    struct tc_segment *segments = NULL;
+    size_t S = tree->segments.n; /* Number of segments. */
+    size_t W = N; /* Total weight of elements. */
+    size_t *NX = NULL; /* Populations by segment index. */
 
-    segments = tc_segments(tree, ds, N, &S);
-    if (segments == NULL)
+    NX = calloc(S > 0 ? S : 1, sizeof(size_t));
+    if (NX == NULL) {
+        errno = ENOMEM;
         return NAN;
-
-    /*
-     * Calculate the log-likelihood.
-     * Part I: contribution of volumes.
-     */
-    l1 = 0;
-    for (s = 0; s < S; s++) {
-        segment = &segments[s];
-        if (segment->NX == 0)
-            continue;
-        if (segment->V == 0)
-            continue;
-        l1 -= segment->NX*log(segment->V);
     }
-    // debug("l1 = %lf\n", l1);
+    route_elements(tree, ds, N, NX);
 
     /*
-     * Calculate the log-likelihood
-     * Part II: contribution of numbers of elements.
+     * Calculate the log-likelihood as a sum of contributions of segments.
+     * The product of Beta functions integrating over segment densities
+     * reduces to NX1!NX2!...NXS!/(N + S)!, so that the contribution
+     * of a segment depends only on its population and volume.
+     * Factorials are looked up in a table, and logarithms of volumes
+     * are taken in a separate pass free of lookups. Weighted elements
+     * count as many elements as their weight.
      */
-    double a = 0, b = 0;
-    l2 = 0;
-    for (s = S-1; s != -1; s--) {
-        a = segments[s].NX + 1;
-        b += (s + 1 < S ? segments[s+1].NX : 0) + 1;
-        // debug("a = %lf, b = %lf\n", a, b);
-        l2 += log_beta(a, b);
+    if (tree_weights(tree, ds, N) != NULL) {
+        for (W = 0, s = 0; s < S; s++)
+            W += NX[s];
     }
-    // debug("l2 = %lf\n", l2);
-
-    l = l1 + l2;
-
-cleanup:
-    if (segments != NULL) {
-        tc_free_segments(segments, S);
-        free(segments);
-        segments = NULL;
+    l = log_likelihood_norm(tree, W, S);
+    for (s = 0; s < S; s++)
+        l += log_factorial(tree, NX[s]);
+    for (s = 0; s < S; s++) {
+        V = segment_volume(tree->segments.nodes[s]);
+        if (NX[s] != 0 && V != 0)
+            l -= NX[s]*log(V);
     }
+    free(NX);
     return l;
 }
+
+double
+tc_log_likelihood(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N
+) {
+    double l = 0; /* Likelihood. */
+
+    if (cached_log_likelihood(tree, ds, N, &l) == 0)
+        return l;
+    return routed_log_likelihood(tree, ds, N);
+}
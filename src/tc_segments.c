@@ -3,16 +3,172 @@
  *
  * tc_segments implementation.
  *
+ * Trees of a run with routing threads route elements on the pool of the run.
+ * Every task counts a chunk of elements into its own array of populations
+ * by segment, and the arrays are summed afterwards. Populations are integers,
+ * so they do not depend on the number of threads.
+ *
  */
 
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <math.h>
 
 #include "misc.h"
+#include "pool.h"
 #include "tc.h"
 #include "tree.h"
+#include "elements.h"
+#include "search.h"
+
+/* Least number of elements routed by one task. */
+#define CHUNK_SIZE 65536
+
+/* Number of tasks per routing thread. */
+#define TASKS_PER_THREAD 4
+
+struct route_task {
+    const struct tc_tree *tree;
+    const void **ds;
+    const uint32_t *weights;
+    size_t N;
+    size_t S; /* Number of segments. */
+    size_t chunk; /* Number of elements of every task. */
+    size_t *NX; /* Populations of every task by segment index. */
+};
+
+/*
+ * Return the segment of `tree` of element `n` of dataset `ds`.
+ * Elements with a missing value are assigned pseudorandomly according
+ * to size of children, the same way as tc_compiled_segment.
+ */
+static const struct tc_node *
+find_segment(const struct tc_tree *tree, const void *ds[], size_t n)
+{
+    size_t i = 0, depth = 0;
+    const struct tc_node *node = tree->root;
+    const struct tc_param_def *pd = NULL;
+    struct tc_range node_r;
+    double x = 0;
+    int64_t c = 0;
+
+    while (!is_segment(node)) {
+        pd = &tree->param_def[node->param];
+        if (pd->type == TC_METRIC) {
+            x = ((const double *) ds[node->param])[n];
+            if (isnan(x)) {
+                node_range(node, node->param, &node_r);
+                x = node_r.min + hrand(n, depth)*(node_r.max - node_r.min);
+                free_range(&node_r);
+            }
+            i = search_cuts(node->cuts, node->ncuts, x);
+        } else if (pd->type == TC_NOMINAL) {
+            c = ((const int64_t *) ds[node->param])[n] - pd->min.int64;
+            if (c >= 0 && c < (int64_t) node->ncategories)
+                i = node->categories[c];
+            else /* Unknown category, as in tc_compiled_segment. */
+                i = hrand(n, depth)*node->nchildren;
+        } else {
+            assert(0);
+        }
+        node = node->children[i];
+        depth++;
+    }
+    return node;
+}
+
+/*
+ * Count chunk `i` of elements of routing task `arg`.
+ */
+static void
+route_chunk(void *arg, size_t i)
+{
+    size_t n = 0, end = 0;
+    struct route_task *t = arg;
+    size_t *NX = &t->NX[i*t->S];
+
+    end = MIN((i + 1)*t->chunk, t->N);
+    for (n = i*t->chunk; n < end; n++) {
+        NX[find_segment(t->tree, t->ds, n)->index] +=
+            t->weights != NULL ? t->weights[n] : 1;
+    }
+}
+
+/*
+ * Returns true if elements of a dataset of `N` elements are routed
+ * on the pool of `tree`.
+ */
+static bool
+routes_parallel(const struct tc_tree *tree, size_t N)
+{
+    return tree->pool != NULL && pool_nthreads(tree->pool) > 1 &&
+        N >= 2*CHUNK_SIZE;
+}
+
+/*
+ * Add populations of segments of `tree` in dataset `ds` of `N` elements
+ * to `NX` by index of the segment in the segment set of the tree, routing
+ * elements on the pool of the tree. Returns 0 on success, -1 on failure.
+ */
+static int
+route_parallel(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    size_t *NX
+) {
+    size_t i = 0, s = 0, ntasks = 0;
+    struct route_task t;
+
+    ntasks = MIN(
+        pool_nthreads(tree->pool)*TASKS_PER_THREAD,
+        N/CHUNK_SIZE
+    );
+    t.tree = tree;
+    t.ds = ds;
+    t.weights = tree_weights(tree, ds, N);
+    t.N = N;
+    t.S = tree->segments.n;
+    t.chunk = (N + ntasks - 1)/ntasks;
+    t.NX = calloc(ntasks*t.S, sizeof(size_t));
+    if (t.NX == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pool_run(tree->pool, route_chunk, &t, ntasks);
+    for (i = 0; i < ntasks; i++) {
+        for (s = 0; s < t.S; s++)
+            NX[s] += t.NX[i*t.S + s];
+    }
+    free(t.NX);
+    return 0;
+}
+
+/*
+ * Add populations of segments of `tree` in dataset `ds` of `N` elements
+ * to `NX` by index of the segment in the segment set of the tree, routing
+ * every element. Without memory for counts of tasks on the pool of the tree,
+ * elements are routed serially.
+ */
+void
+route_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    size_t *NX
+) {
+    size_t n = 0;
+    const uint32_t *weights = NULL;
+
+    if (routes_parallel(tree, N) && route_parallel(tree, ds, N, NX) == 0)
+        return;
+    weights = tree_weights(tree, ds, N);
+    for (n = 0; n < N; n++)
+        NX[find_segment(tree, ds, n)->index] += weights != NULL ? weights[n] : 1;
+}
 
 struct tc_segment *
 tc_segments(
@@ -21,14 +177,13 @@ tc_segments(
     size_t N,
     size_t *S
 ) {
-    size_t n = 0, s = 0, k = 0, i = 0;
-    struct tc_node *node = NULL;
-    const struct tc_param_def *pd = NULL;
-    union tc_valuep data;
+    size_t s = 0, k = 0;
+    const struct tc_node *node = NULL;
     struct tc_range *range = NULL;
     struct tc_segment *segments = NULL;
     struct tc_segment *segment = NULL;
-    double *p = NULL;
+    bool stats = has_stats(tree, ds, N);
+    size_t *NX = NULL;
     double V = 0;
 
     *S = count_segments(tree);
@@ -41,70 +196,119 @@ tc_segments(
     for (s = 0; s < *S; s++)
         init_segment(&segments[s], tree->K);
 
-    s = 0;
-    for (node = tree->first; node != NULL; node = node->next) {
-        if (!is_segment(node))
-            continue;
+    /*
+     * Trees of the sampler passed to the callback already have
+     * the populations of their segments. Otherwise elements are counted
+     * by index of their segment in the segment set of the tree.
+     */
+    if (!stats) {
+        NX = calloc(*S > 0 ? *S : 1, sizeof(size_t));
+        if (NX == NULL) {
+            errno = ENOMEM;
+            goto error;
+        }
+        route_elements(tree, ds, N, NX);
+    }
+
+    /* Segments are in the order of the segment set, as in all segment APIs. */
+    for (s = 0; s < *S; s++) {
+        node = tree->segments.nodes[s];
         segment = &segments[s];
-        node->_aux = segment;
+        segment->NX = stats ? node_weight(node) : NX[s];
         /* Determine volume of the segment. */
         segment->V = 1.;
         for (k = 0; k < tree->K; k++) {
             range = &segment->ranges[k];
-            pd = &tree->param_def[k];
             node_range(node, k, range);
             V = range->max - range->min;
             segment->V *= V > 0 ? V : 1;
         }
-        s++;
     }
+    free(NX);
+    return segments;
+error:
+    free(NX);
+    tc_free_segments(segments, *S);
+    free(segments);
+    return NULL;
+}
 
-    for (n = 0; n < N; n++) {
-        /*
-         * Find element in tree.
-         */
-        node = tree->root;
-        while (node != NULL) {
-            if (is_segment(node)) {
-                segment = (struct tc_segment *) node->_aux;
-                segment->NX++;
-                break;
-            }
+size_t
+tc_segments_into(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    struct tc_segment_view *buf,
+    double *ranges_buf,
+    uint64_t *catsets_buf,
+    size_t cap
+) {
+    size_t n = 0, s = 0, S = tree->segments.n, K = tree->K;
+    size_t C = tree->catset_words;
+    bool stats = has_stats(tree, ds, N);
+    const uint32_t *weights = tree_weights(tree, ds, N);
+    const struct tc_node *node = NULL;
+    size_t *NX = NULL;
 
-            pd = &tree->param_def[node->param];
-            data.buf = ds[node->param];
-
-            if (pd->type == TC_METRIC) {
-                if (isnan(data.float64[n])) {
-                    /* Assign element randomly according to size of children. */
-                    p = calloc(node->nchildren, sizeof(double));
-                    if (p == NULL) {
-                        errno = ENOMEM;
-                        return NULL;
-                    }
-                    for (i = 0; i < node->nchildren; i++) {
-                        struct tc_range range;
-                        node_range(node->children[i], node->param, &range);
-                        p[i] = range.max - range.min;
-                        free_range(&range);
-                    }
-                    i = sample(node->nchildren, p);
-                    free(p);
-                    p = NULL;
-                } else {
-                    for (i = 0; i  < node->ncuts; i++) {
-                        if (data.float64[n] <= node->cuts[i])
-                            break;
-                    }
-                }
-            } else if (pd->type == TC_NOMINAL) {
-                i = node->categories[data.int64[n]];
-            } else {
-                assert(0);
-            }
-            node = node->children[i];
+    if (S > cap)
+        return S;
+    /*
+     * Segments are in the order of the segment set of the tree, so that
+     * an element is counted in the view of its segment by index.
+     */
+    for (s = 0; s < S; s++) {
+        node = tree->segments.nodes[s];
+        buf[s].NX = stats ? node_weight(node) : 0;
+        buf[s].V = segment_volume(node);
+        memcpy(&ranges_buf[2*K*s], node->box, 2*K*sizeof(double));
+        buf[s].ranges = &ranges_buf[2*K*s];
+        buf[s].catsets = NULL;
+        if (C > 0) {
+            memcpy(&catsets_buf[C*s], node->catsets, C*sizeof(uint64_t));
+            buf[s].catsets = &catsets_buf[C*s];
         }
     }
+    if (stats)
+        return S;
+    /* Without memory for counts of tasks, elements are routed serially. */
+    if (routes_parallel(tree, N) &&
+        (NX = calloc(S > 0 ? S : 1, sizeof(size_t))) != NULL &&
+        route_parallel(tree, ds, N, NX) == 0) {
+        for (s = 0; s < S; s++)
+            buf[s].NX = NX[s];
+        free(NX);
+        return S;
+    }
+    free(NX);
+    for (n = 0; n < N; n++) {
+        buf[find_segment(tree, ds, n)->index].NX +=
+            weights != NULL ? weights[n] : 1;
+    }
+    return S;
+}
 
-    return segments;
+void
+tc_segment_cursor_init(
+    struct tc_segment_cursor *cursor,
+    const struct tc_tree *tree
+) {
+    cursor->tree = tree;
+    cursor->s = 0;
+}
+
+bool
+tc_segment_next(
+    struct tc_segment_cursor *cursor,
+    struct tc_segment_view *view
+) {
+    const struct tc_node *node = NULL;
+
+    if (cursor->s >= cursor->tree->segments.n)
+        return false;
+    node = cursor->tree->segments.nodes[cursor->s++];
+    view->NX = node_weight(node);
+    view->V = segment_volume(node);
+    view->ranges = node->box;
+    view->catsets = node->catsets;
+    return true;
 }
@@ -6,6 +6,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <assert.h>
 #include <math.h>
@@ -15,6 +16,9 @@
 #include "tree.h"
 #include "tc.h"
 
+/* Index of a node which is not in a set. */
+#define NONE ((size_t) -1)
+
 union tc_value
 min(union tc_valuep data, size_t N, enum tc_param_size size)
 {
@@ -45,7 +49,7 @@ max(union tc_valuep data, size_t N, enum tc_param_size size)
             if (isnan(value.float64) || data.float64[n] > value.float64)
                 value.float64 = data.float64[n];
     } else if (size == TC_INT64) {
-        value.int64 = INT64_MAX;
+        value.int64 = INT64_MIN;
         for (n = 0; n < N; n++)
             if (data.int64[n] > value.int64)
                 value.int64 = data.int64[n];
@@ -97,13 +101,246 @@ tree_alloc(struct tc_tree *tree, size_t size)
 }
 
 /*
- * Attach `node` to `tree`. The node is added to the sequential traversing.
- * The node needs to be added to the tree structure in addition.
+ * Allocate offsets of category bitsets of nominal parameters of tree `tree`.
+ * Must be called before any node is allocated. Returns 0 on success, -1
+ * on failure.
+ */
+int
+init_catsets(struct tc_tree *tree)
+{
+    size_t k = 0;
+    const struct tc_param_def *pd = NULL;
+    tree->catset_off = tree_alloc(tree, (tree->K + 1)*sizeof(size_t));
+    if (tree->catset_off == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    tree->catset_words = 0;
+    for (k = 0; k < tree->K; k++) {
+        pd = &tree->param_def[k];
+        tree->catset_off[k] = tree->catset_words;
+        if (pd->type == TC_NOMINAL)
+            tree->catset_words += BITSET_WORDS(NCATEGORIES(pd));
+    }
+    return 0;
+}
+
+/*
+ * Return the bitset of categories of `node` in nominal parameter `param`.
+ * Bit `c` is set if category `c` (counted from the minimum of the parameter)
+ * belongs to the node.
+ */
+uint64_t *
+node_catset(const struct tc_node *node, size_t param)
+{
+    return node->catsets + node->tree->catset_off[param];
+}
+
+/*
+ * Return the number of bits set in bitset `set` of `nwords` words.
+ */
+size_t
+bitset_count(const uint64_t *set, size_t nwords)
+{
+    size_t i = 0, n = 0;
+    for (i = 0; i < nwords; i++)
+        n += __builtin_popcountll(set[i]);
+    return n;
+}
+
+/*
+ * Return the index of the `r`-th bit set in bitset `set` of `nwords` words,
+ * which needs to have more than `r` bits set.
+ */
+size_t
+bitset_select(const uint64_t *set, size_t nwords, size_t r)
+{
+    size_t i = 0, n = 0;
+    uint64_t w = 0;
+    for (i = 0; i < nwords; i++) {
+        n = __builtin_popcountll(set[i]);
+        if (r < n) break;
+        r -= n;
+    }
+    assert(i < nwords);
+    for (w = set[i]; r > 0; r--)
+        w &= w - 1;
+    return 64*i + __builtin_ctzll(w);
+}
+
+/*
+ * Allocate a node on the tree `tree`. Nodes returned to the free list
+ * of the tree by tree_free_node are reused before the tree buffer.
+ * Children and cuts of the node are stored inline. Returns NULL on failure.
+ */
+struct tc_node *
+tree_alloc_node(struct tc_tree *tree)
+{
+    struct tc_node *node = NULL;
+    double *box = NULL;
+    uint64_t *catsets = NULL;
+    if (tree->free_nodes != NULL) {
+        node = tree->free_nodes;
+        tree->free_nodes = node->next;
+        box = node->box;
+        catsets = node->catsets;
+        bzero(node, sizeof(struct tc_node));
+    } else {
+        node = tree_alloc(tree, sizeof(struct tc_node));
+        if (node == NULL) return NULL;
+        box = tree_alloc(tree, 2*tree->K*sizeof(double));
+        if (box == NULL) return NULL;
+        catsets = tree_alloc(tree, tree->catset_words*sizeof(uint64_t));
+        if (catsets == NULL) return NULL;
+    }
+    node->tree = tree;
+    node->box = box;
+    node->catsets = catsets;
+    node->children = node->_children;
+    node->cuts = node->_cuts;
+    node->movable = node->_movable;
+    node->capacity = TC_NODE_INLINE;
+    node->index = NONE;
+    return node;
+}
+
+/*
+ * Return `node` and its descendants to the free list of its tree.
+ * The node needs to be removed from the tree structure and sequential
+ * traversing beforehand.
  */
 void
-tree_attach_node(struct tc_node *node)
+tree_free_node(struct tc_node *node)
 {
     size_t i = 0;
+    struct tc_tree *tree = NULL;
+    tree = node->tree;
+    for (i = 0; i < node->nchildren; i++)
+        tree_free_node(node->children[i]);
+    node->nchildren = 0;
+    node->parent = NULL;
+    node->prev = NULL;
+    node->next = tree->free_nodes;
+    tree->free_nodes = node;
+}
+
+/*
+ * Ensure that node `node` has capacity for `n` children. Children and cuts
+ * of wide nodes are stored in the tree buffer, with capacity doubled
+ * when exceeded. Returns 0 on success, -1 on failure.
+ */
+int
+node_reserve(struct tc_node *node, size_t n)
+{
+    size_t capacity = 0;
+    struct tc_node **children = NULL;
+    double *cuts = NULL;
+    size_t *movable = NULL;
+
+    if (n <= node->capacity)
+        return 0;
+    capacity = MAX(n, 2*node->capacity);
+    children = tree_alloc(node->tree, capacity*sizeof(struct tc_node *));
+    cuts = tree_alloc(node->tree, (capacity - 1)*sizeof(double));
+    movable = tree_alloc(node->tree, (capacity - 1)*sizeof(size_t));
+    if (children == NULL || cuts == NULL || movable == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    bcopy(node->children, children, node->nchildren*sizeof(struct tc_node *));
+    bcopy(node->cuts, cuts, node->ncuts*sizeof(double));
+    bcopy(node->movable, movable, node->nmovable*sizeof(size_t));
+    node->children = children;
+    node->cuts = cuts;
+    node->movable = movable;
+    node->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Insert cut `cut` before cut `i` of metric node `node`. Child `i` is split
+ * in two: it stays in place below the cut, and a new segment is inserted
+ * after it. Returns 0 on success, -1 on failure.
+ */
+int
+insert_cut(struct tc_node *node, size_t i, double cut)
+{
+    struct tc_node *leaf = NULL;
+
+    if (node_reserve(node, node->nchildren + 1) != 0)
+        return -1;
+    leaf = tc_new_leaf(node->tree);
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memmove(
+        &node->children[i+2],
+        &node->children[i+1],
+        (node->nchildren - i - 1)*sizeof(struct tc_node *)
+    );
+    memmove(
+        &node->cuts[i+1],
+        &node->cuts[i],
+        (node->ncuts - i)*sizeof(double)
+    );
+    node->children[i+1] = leaf;
+    node->cuts[i] = cut;
+    node->nchildren++;
+    node->ncuts++;
+    leaf->parent = node;
+    if (tree_attach_node(leaf) != 0)
+        return -1;
+    update_boxes(node->children[i]);
+    update_boxes(leaf);
+    return update_supersegment(node);
+}
+
+/*
+ * Remove cut `i` of node `node`, which needs to have more than two
+ * children. Child `i + 1` is freed, and child `i` takes over its range
+ * (metric node) or its categories (nominal node). Returns 0 on success,
+ * -1 on failure.
+ */
+int
+remove_cut(struct tc_node *node, size_t i)
+{
+    size_t c = 0;
+    struct tc_node *child = NULL;
+
+    assert(node->nchildren > 2);
+    child = node->children[i+1];
+    memmove(
+        &node->children[i+1],
+        &node->children[i+2],
+        (node->nchildren - i - 2)*sizeof(struct tc_node *)
+    );
+    if (IS_METRIC(node)) {
+        memmove(
+            &node->cuts[i],
+            &node->cuts[i+1],
+            (node->ncuts - i - 1)*sizeof(double)
+        );
+        node->ncuts--;
+    } else if (IS_NOMINAL(node)) {
+        for (c = 0; c < node->ncategories; c++) {
+            if (node->categories[c] > (int64_t) i)
+                node->categories[c]--;
+        }
+    } else assert(0);
+    node->nchildren--;
+    tree_detach_node(child);
+    tree_free_node(child);
+    update_boxes(node->children[i]);
+    return update_supersegment(node);
+}
+
+/*
+ * Append `node` to the sequential traversing of its tree.
+ */
+static void
+append_node(struct tc_node *node)
+{
     struct tc_tree *tree = NULL;
     tree = node->tree;
     node->next = NULL;
@@ -113,8 +350,91 @@ tree_attach_node(struct tc_node *node)
     tree->last = node;
     if (tree->first == NULL)
         tree->first = node;
-    for (i = 0; i < node->nchildren; i++)
-        tree_attach_node(node->children[i]);
+}
+
+/*
+ * Add `node` to set `set` of its tree, growing the set in the tree buffer
+ * when full. Returns 0 on success, -1 on failure.
+ */
+static int
+set_add(struct tc_node_set *set, struct tc_node *node)
+{
+    size_t size = 0;
+    struct tc_node **nodes = NULL;
+    if (set->n == set->size) {
+        size = MAX(2*set->size, 16);
+        nodes = tree_alloc(node->tree, size*sizeof(struct tc_node *));
+        if (nodes == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (set->n > 0)
+            memcpy(nodes, set->nodes, set->n*sizeof(struct tc_node *));
+        set->nodes = nodes;
+        set->size = size;
+    }
+    node->index = set->n;
+    set->nodes[set->n++] = node;
+    return 0;
+}
+
+/*
+ * Remove `node` from set `set`. The last node of the set takes its place.
+ */
+static void
+set_remove(struct tc_node_set *set, struct tc_node *node)
+{
+    struct tc_node *last = NULL;
+    assert(set->nodes[node->index] == node);
+    last = set->nodes[--set->n];
+    set->nodes[node->index] = last;
+    last->index = node->index;
+    node->index = NONE;
+}
+
+/*
+ * Update movable cuts of node `node` and its membership in supersegments
+ * of its tree. Must be called when children of an attached node change.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+update_supersegment(struct tc_node *node)
+{
+    size_t i = 0;
+    bool is = false;
+
+    node->nmovable = 0;
+    for (i = 0; i + 1 < node->nchildren; i++) {
+        if (is_movable_cut(node, i))
+            node->movable[node->nmovable++] = i;
+    }
+    is = node->nmovable > 0;
+
+    if (is && node->index == NONE)
+        return set_add(&node->tree->supersegments, node);
+    if (!is && node->index != NONE)
+        set_remove(&node->tree->supersegments, node);
+    return 0;
+}
+
+/*
+ * Attach `node` to `tree`. The node is added to the sequential traversing,
+ * and to segments or supersegments of the tree. The node needs to be added
+ * to the tree structure beforehand. Returns 0 on success, -1 on failure.
+ */
+int
+tree_attach_node(struct tc_node *node)
+{
+    size_t i = 0;
+    append_node(node);
+    node->index = NONE;
+    for (i = 0; i < node->nchildren; i++) {
+        if (tree_attach_node(node->children[i]) != 0)
+            return -1;
+    }
+    if (is_segment(node))
+        return set_add(&node->tree->segments, node);
+    return update_supersegment(node);
 }
 
 /*
@@ -129,6 +449,12 @@ tree_detach_node(struct tc_node *node)
     tree = node->tree;
     for (i = 0; i < node->nchildren; i++)
         tree_detach_node(node->children[i]);
+    if (node->index != NONE) {
+        if (is_segment(node))
+            set_remove(&tree->segments, node);
+        else
+            set_remove(&tree->supersegments, node);
+    }
     if (node->prev) node->prev->next = node->next;
     if (node->next) node->next->prev = node->prev;
     if (tree->last == node) tree->last = node->prev;
@@ -137,6 +463,32 @@ tree_detach_node(struct tc_node *node)
     node->next = NULL;
 }
 
+/*
+ * Return the number of bytes of tree buffer used by nodes attached
+ * to `tree`.
+ */
+size_t
+tree_live_size(const struct tc_tree *tree)
+{
+    size_t size = 0;
+    const struct tc_node *node = NULL;
+    for (node = tree->first; node != NULL; node = node->next) {
+        size += sizeof(struct tc_node);
+        size += 2*tree->K*sizeof(double);
+        size += tree->catset_words*sizeof(uint64_t);
+        if (node->capacity > TC_NODE_INLINE) {
+            size += node->capacity*sizeof(struct tc_node *);
+            size += (node->capacity - 1)*sizeof(double);
+            size += (node->capacity - 1)*sizeof(size_t);
+        }
+        size += node->ncategories*sizeof(int64_t);
+    }
+    size += (tree->K + 1)*sizeof(size_t);
+    size += tree->segments.size*sizeof(struct tc_node *);
+    size += tree->supersegments.size*sizeof(struct tc_node *);
+    return size;
+}
+
 /*
  * Copy node `node` to the tree `tree`. Child nodes are preserved
  * (point to the old tree). Returns pointer to the new node or NULL on failure.
@@ -144,30 +496,175 @@ tree_detach_node(struct tc_node *node)
 struct tc_node *
 copy_node(const struct tc_node *node, struct tc_tree *tree)
 {
+    struct tc_node *new = NULL;
+    double *box = NULL;
+    uint64_t *catsets = NULL;
+
+    new = tree_alloc_node(tree);
+    if (new == NULL) goto error;
+    box = new->box;
+    catsets = new->catsets;
+    *new = *node;
+    new->tree = tree;
+    new->box = box;
+    new->catsets = catsets;
+    bcopy(node->box, new->box, 2*tree->K*sizeof(double));
+    bcopy(
+        node->catsets,
+        new->catsets,
+        tree->catset_words*sizeof(uint64_t)
+    );
+    new->next = NULL;
+    new->prev = NULL;
+    new->children = new->_children;
+    new->cuts = new->_cuts;
+    new->movable = new->_movable;
+    new->capacity = TC_NODE_INLINE;
+    new->nchildren = 0;
+    new->ncuts = 0;
+    new->nmovable = 0;
+    if (node_reserve(new, node->nchildren) != 0) goto error;
+    new->nchildren = node->nchildren;
+    new->ncuts = node->ncuts;
+    new->nmovable = node->nmovable;
+    bcopy(node->movable, new->movable, node->nmovable*sizeof(size_t));
+    bcopy(
+        node->children,
+        new->children,
+        node->nchildren*sizeof(struct tc_node *)
+    );
+    bcopy(node->cuts, new->cuts, node->ncuts*sizeof(double));
+
+    if (node->ncategories > 0) {
+        new->categories = tree_alloc(
+            tree,
+            node->ncategories*sizeof(int64_t)
+        );
+        if (new->categories == NULL) goto error;
+        bcopy(
+            node->categories,
+            new->categories,
+            node->ncategories*sizeof(int64_t)
+        );
+    }
+    return new;
+error:
+    errno = ENOMEM;
+    return NULL;
+}
 
+/*
+ * Allocate set `set` of tree `tree` with the size of set `old`.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+copy_set(
+    struct tc_tree *tree,
+    struct tc_node_set *set,
+    const struct tc_node_set *old
+) {
+    set->n = old->n;
+    set->size = old->size;
+    set->nodes = tree_alloc(tree, set->size*sizeof(struct tc_node *));
+    if (set->nodes == NULL && set->size > 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
 }
 
 /*
- * Compact tree `old` into tree `new`. Returns 0 on success, -1 on failure.
+ * Compact tree `old` into tree `new`. Nodes attached to `old` are copied
+ * into the buffer of `new` in breadth-first order, and any previous content
+ * of `new` is discarded. Segments and supersegments keep their order.
+ * Elements of `old` are shared with `new`. Returns 0 on success, -1
+ * on failure.
  */
 int
 compact_tree(struct tc_tree *new, const struct tc_tree *old)
 {
     size_t i = 0;
-    const struct tc_node *node = NULL;
-    copy_node(old->root, new);
+    struct tc_node *node = NULL, *child = NULL;
+
+    new->param_def = old->param_def;
+    new->K = old->K;
+    new->N = old->N;
+    new->elements = old->elements;
+    new->ds = old->ds;
+    new->weights = old->weights;
+    new->cumw = old->cumw;
+    new->lfact = old->lfact;
+    new->nlfact = old->nlfact;
+    new->quantized = old->quantized;
+    new->sat = old->sat;
+    new->stats_ds = old->stats_ds;
+    new->pool = old->pool;
+    new->p = new->buf;
+    new->free_nodes = NULL;
+    new->first = NULL;
+    new->last = NULL;
+    new->root = NULL;
+    if (init_catsets(new) != 0)
+        return -1;
+    if (copy_set(new, &new->segments, &old->segments) != 0 ||
+        copy_set(new, &new->supersegments, &old->supersegments) != 0)
+        return -1;
+
+    node = copy_node(old->root, new);
     if (node == NULL) return -1;
+    node->parent = NULL;
+    new->root = node;
+    append_node(node);
     while (node != NULL) {
         /* Copy children to the new tree. */
         for (i = 0; i < node->nchildren; i++) {
-            node->children[i] = copy_node(node->children[i], new);
-            if (node->children[i] == NULL) return -1;
+            child = copy_node(node->children[i], new);
+            if (child == NULL) return -1;
+            child->parent = node;
+            node->children[i] = child;
+            append_node(child);
+        }
+        if (node->index != NONE) {
+            if (is_segment(node))
+                new->segments.nodes[node->index] = node;
+            else
+                new->supersegments.nodes[node->index] = node;
         }
         node = node->next;
     }
     return 0;
 }
 
+/*
+ * Compact tree `*tree` when nodes replaced by accepted proposals take up
+ * more than half of its buffer. Live nodes are copied into a new buffer
+ * of at least `size` bytes and four times their size, so that memory stays
+ * proportional to the live tree. Returns 0 on success, -1 on failure.
+ */
+int
+tree_compact(struct tc_tree **tree, size_t size)
+{
+    struct tc_tree *new = NULL;
+
+    if ((size_t) ((*tree)->p - (*tree)->buf) <= (*tree)->size/2)
+        return 0;
+    size = MAX(size, 4*tree_live_size(*tree));
+    new = tc_new_tree(size, (*tree)->param_def, (*tree)->K);
+    if (new == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (compact_tree(new, *tree) != 0) {
+        free(new);
+        errno = ENOMEM;
+        return -1;
+    }
+    new->chain = (*tree)->chain;
+    free(*tree);
+    *tree = new;
+    return 0;
+}
+
 /*
  * Initialize segment `segment`. `K` is the number of child nodes.
  * Initialized segment needs to be freed with free_segment.
@@ -185,9 +682,99 @@ init_segment(struct tc_segment *segment, size_t K)
     }
 }
 
+/*
+ * Determine the box of child `i` of node `node` from the box of the node,
+ * and its volume.
+ */
+static void
+child_box(const struct tc_node *node, size_t i, struct tc_node *child)
+{
+    size_t k = 0, c = 0, param = node->param;
+    double V = 1, w = 0;
+    uint64_t *set = NULL;
+    bcopy(node->box, child->box, 2*node->tree->K*sizeof(double));
+    bcopy(
+        node->catsets,
+        child->catsets,
+        node->tree->catset_words*sizeof(uint64_t)
+    );
+    if (IS_METRIC(node)) {
+        if (i != 0)
+            child->box[2*param] = MAX(child->box[2*param], node->cuts[i-1]);
+        if (i + 1 != node->nchildren)
+            child->box[2*param+1] = MIN(child->box[2*param+1], node->cuts[i]);
+    } else if (IS_NOMINAL(node)) {
+        /* Range of a nominal parameter is (0, number of categories). */
+        set = node_catset(child, param);
+        for (c = 0; c < node->ncategories; c++) {
+            if (node->categories[c] != (int64_t) i)
+                BITSET_CLEAR(set, c);
+        }
+        child->box[2*param] = 0;
+        child->box[2*param+1] = bitset_count(
+            set,
+            BITSET_WORDS(node->ncategories)
+        );
+    } else assert(0);
+    for (k = 0; k < node->tree->K; k++) {
+        w = child->box[2*k+1] - child->box[2*k];
+        V *= w > 0 ? w : 1;
+    }
+    child->V = V;
+}
+
+/*
+ * Update boxes of descendants of `node` from the box of the node.
+ */
+static void
+update_subtree_boxes(struct tc_node *node)
+{
+    size_t i = 0;
+    for (i = 0; i < node->nchildren; i++) {
+        child_box(node, i, node->children[i]);
+        update_subtree_boxes(node->children[i]);
+    }
+}
+
+/*
+ * Update the box (range in every parameter) and volume of `node`
+ * and its descendants. Must be called when the node is placed in the tree,
+ * or when cuts of its parent change.
+ */
+void
+update_boxes(struct tc_node *node)
+{
+    size_t k = 0, c = 0;
+    double V = 1, w = 0;
+    const struct tc_param_def *pd = NULL;
+
+    if (node->parent != NULL) {
+        child_box(node->parent, find_child(node->parent, node), node);
+    } else {
+        for (k = 0; k < node->tree->K; k++) {
+            pd = &node->tree->param_def[k];
+            if (pd->type == TC_NOMINAL) {
+                for (c = 0; c < NCATEGORIES(pd); c++)
+                    BITSET_SET(node_catset(node, k), c);
+                node->box[2*k] = 0;
+                node->box[2*k+1] = NCATEGORIES(pd);
+            } else {
+                node->box[2*k] = pd->min.float64;
+                node->box[2*k+1] = pd->max.float64;
+            }
+            w = node->box[2*k+1] - node->box[2*k];
+            V *= w > 0 ? w : 1;
+        }
+        node->V = V;
+    }
+    update_subtree_boxes(node);
+}
+
 /*
  * Determine range of node `node` in parameter `param`. The result is saved
- * to `range. The callee should call free_range on `range` after use.
+ * to `range. The range of a nominal parameter is (0, number of categories),
+ * and its categories are listed in `range->categories`. The callee should
+ * call free_range on `range` after use.
  */
 void
 node_range(
@@ -195,33 +782,112 @@ node_range(
     size_t param,
     struct tc_range *range
 ) {
-    size_t i = 0;
-    const struct tc_node *n = NULL, *child = NULL;
+    size_t c = 0, n = 0;
+    const uint64_t *set = NULL;
     const struct tc_param_def *pd = NULL;
 
-    n = node;
-    pd = &node->tree->param_def[param];
-    range->min = pd->min.float64;
-    range->max = pd->max.float64;
+    range->min = node->box[2*param];
+    range->max = node->box[2*param+1];
     range->categories = NULL;
     range->ncategories = 0;
+    pd = &node->tree->param_def[param];
+    if (pd->type != TC_NOMINAL)
+        return;
+    set = node_catset(node, param);
+    n = bitset_count(set, BITSET_WORDS(NCATEGORIES(pd)));
+    range->categories = calloc(n > 0 ? n : 1, sizeof(int64_t));
+    if (range->categories == NULL)
+        return;
+    for (c = 0; c < NCATEGORIES(pd); c++) {
+        if (BITSET_GET(set, c))
+            range->categories[range->ncategories++] = pd->min.int64 + c;
+    }
+}
 
-    for (n = node->parent, child = node; n != NULL; child = n, n = n->parent) {
-        if (n->param != param) continue;
-        if (pd->type == TC_METRIC) {
-            for (i = 0; i < n->nchildren; i++) {
-                if (n->children[i] == child)
-                    break; /* Found. */
-            }
-            assert(i != n->nchildren);
-            if (i != 0)
-                range->min = MAX(range->min, n->cuts[i-1]);
-            if (i + 1 != n->nchildren)
-                range->max = MIN(range->max, n->cuts[i]);
-        } else if(pd->type == TC_NOMINAL) {
-            /* Not implemented. */
-        } else assert(0);
+/*
+ * Determine volume of node `node` (product of ranges).
+ */
+double
+segment_volume(const struct tc_node *node)
+{
+    return node->V;
+}
+
+/*
+ * Determine volume of node `node` with range in parameter `param` replaced
+ * by (`min`, `max`). Used for evaluating proposals before the tree is changed.
+ */
+double
+range_volume(
+    const struct tc_node *node,
+    size_t param,
+    double min,
+    double max
+) {
+    size_t k = 0;
+    double V = 1, w = 0;
+    for (k = 0; k < node->tree->K; k++) {
+        if (k == param)
+            w = max - min;
+        else
+            w = node->box[2*k+1] - node->box[2*k];
+        V *= w > 0 ? w : 1;
     }
+    return V;
+}
+
+/*
+ * Create a table of log(n!) for n = 0, ..., `size` - 1. Returns NULL
+ * on failure.
+ */
+double *
+new_log_factorial_table(size_t size)
+{
+    size_t n = 0;
+    double *table = NULL;
+    table = calloc(size > 0 ? size : 1, sizeof(double));
+    if (table == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (n = 0; n < size; n++)
+        table[n] = lgamma(n + 1);
+    return table;
+}
+
+/*
+ * Return log(n!), looked up in the table of tree `tree` if it has one.
+ */
+double
+log_factorial(const struct tc_tree *tree, size_t n)
+{
+    if (n < tree->nlfact)
+        return tree->lfact[n];
+    return lgamma(n + 1);
+}
+
+/*
+ * Log-likelihood contribution of a segment of tree `tree` with `NX` elements
+ * and volume `V`. The log-likelihood of a tree is the sum of contributions
+ * of its segments and log_likelihood_norm.
+ */
+double
+segment_log_likelihood(const struct tc_tree *tree, size_t NX, double V)
+{
+    double l = log_factorial(tree, NX);
+    if (NX != 0 && V != 0)
+        l -= NX*log(V);
+    return l;
+}
+
+/*
+ * Log-likelihood normalization term of `N` elements in `S` segments
+ * of tree `tree`.
+ */
+double
+log_likelihood_norm(const struct tc_tree *tree, size_t N, size_t S)
+{
+    return -log_factorial(tree, N + S);
 }
 
 /*
@@ -275,6 +941,22 @@ check_subtree(const struct tc_tree *tree, const struct tc_node *node)
         for (i = 1; i < node->ncuts; i++)
             if (node->cuts[i] < node->cuts[i-1])
                 return false;
+    } else if (pd->type == TC_NOMINAL && !is_segment(node)) {
+        for (i = 0; i < node->ncategories; i++)
+            if (node->categories[i] < 0 ||
+                node->categories[i] >= (int64_t) node->nchildren)
+                return false;
+    }
+    if (is_segment(node)) {
+        if (node->index >= tree->segments.n ||
+            tree->segments.nodes[node->index] != node)
+            return false;
+    } else if (is_supersegment(node)) {
+        if (node->index >= tree->supersegments.n ||
+            tree->supersegments.nodes[node->index] != node)
+            return false;
+    } else if (node->index != NONE) {
+        return false;
     }
     return true;
 }
@@ -285,63 +967,55 @@ check_subtree(const struct tc_tree *tree, const struct tc_node *node)
 size_t
 count_segments(const struct tc_tree *tree)
 {
-    size_t n = 0;
-    struct tc_node *node = NULL;
-    node = tree->first;
-    while (node != NULL) {
-        if (is_segment(node)) n++;
-        node = node->next;
-    }
-    return n;
+    return tree->segments.n;
+}
+
+/*
+ * Returns true if elements of nodes of `tree` are those of dataset `ds`
+ * of `N` elements, as tc_segments would count them.
+ */
+bool
+has_stats(const struct tc_tree *tree, const void *ds[], size_t N)
+{
+    return tree->stats_ds != NULL && tree->stats_ds == ds && tree->N == N;
+}
+
+/*
+ * Return weights of elements of dataset `ds` of `N` elements with which
+ * `tree` was sampled, or NULL if elements of the dataset are not weighted.
+ */
+const uint32_t *
+tree_weights(const struct tc_tree *tree, const void *ds[], size_t N)
+{
+    if (tree->ds != ds || tree->N != N) return NULL;
+    return tree->weights;
 }
 
 /*
  * Return the `s`-th segment of tree `tree` or NULL if s is greater than
- * the number of segments.
+ * the number of segments. Segments are in no particular order.
  */
 struct tc_node *
 select_segment(const struct tc_tree *tree, size_t s)
 {
-    size_t n = 0;
-    struct tc_node *node = NULL;
-    node = tree->first;
-    while (node != NULL) {
-        if (is_segment(node)) {
-            if (n == s) return node;
-            n++;
-        }
-        node = node->next;
-    }
-    return NULL;
+    if (s >= tree->segments.n) return NULL;
+    return tree->segments.nodes[s];
 }
 
 /* Return true if a `node` is a supersegment, or false otherwise.
- * Supersegment is a node with two adjacent segments (metric parameter),
- * resp. two or more segments (nominal parameter).
+ * Supersegment is a node with two adjacent segments.
  */
 bool
 is_supersegment(const struct tc_node *node)
 {
     size_t i = 0;
-    size_t S = 0;
-    const struct tc_param_def *pd = NULL;
-    pd = &node->tree->param_def[node->param];
-    if (pd->type == TC_METRIC) {
-        /* Need two adjacent segments. */
-        for (i = 1; i < node->nchildren; i++) {
-            if (is_segment(node->children[i-1]) &&
-                is_segment(node->children[i]))
-            {
-                return true;
-            }
+    for (i = 1; i < node->nchildren; i++) {
+        if (is_segment(node->children[i-1]) &&
+            is_segment(node->children[i]))
+        {
+            return true;
         }
-    } else if(pd->type == TC_NOMINAL) {
-        /* Need two segments. */
-        S = 0;
-        for (i = 0; i < node->nchildren; i++)
-            if (is_segment(node->children[i])) S++;
-        return S >=2;
-    } else assert(0);
+    }
     return false;
 }
 
@@ -351,45 +1025,30 @@ is_supersegment(const struct tc_node *node)
 size_t
 count_supersegments(const struct tc_tree *tree)
 {
-    size_t n = 0;
-    struct tc_node *node = NULL;
-    node = tree->first;
-    while (node != NULL) {
-        if (is_supersegment(node))
-            n++;
-        node = node->next;
-    }
-    return n;
+    return tree->supersegments.n;
 }
 
 /*
  * Return the `ss`-th supersegment of `tree`, or NULL if `ss` is greater
- * than the number of supersegments.
+ * than the number of supersegments. Supersegments are in no particular
+ * order.
  */
 struct tc_node *
 select_supersegment(const struct tc_tree *tree, size_t ss)
 {
-    size_t i = 0;
-    struct tc_node *node = NULL;
-    node = tree->first;
-    while (node != NULL) {
-        if (is_supersegment(node))
-            if (i++ == ss) return node;
-        node = node->next;
-    }
-    return NULL;
+    if (ss >= tree->supersegments.n) return NULL;
+    return tree->supersegments.nodes[ss];
 }
 
 /*
- * Return true if cut `i` of a metric node `node` is movable, false otherwise.
- * Movable cut is a cut between two segments.
+ * Return true if cut `i` of `node` is movable, false otherwise.
+ * Movable cut is a cut between two segments. Cut `i` of a nominal node
+ * is the boundary between children `i` and `i + 1`, across which
+ * categories are reassigned.
  */
 bool
 is_movable_cut(const struct tc_node *node, size_t i)
 {
-    const struct tc_param_def *pd = NULL;
-    pd = &node->tree->param_def[node->param];
-    assert(pd->type == TC_METRIC);
     return is_segment(node->children[i]) &&
         is_segment(node->children[i+1]);
 }
@@ -400,13 +1059,7 @@ is_movable_cut(const struct tc_node *node, size_t i)
 size_t
 count_movable_cuts(const struct tc_node *node)
 {
-    size_t i = 0;
-    size_t n = 0;
-    for (i = 0; i + 1 < node->nchildren; i++) {
-        if (is_movable_cut(node, i))
-            n++;
-    }
-    return n;
+    return node->nmovable;
 }
 
 /*
@@ -415,10 +1068,6 @@ count_movable_cuts(const struct tc_node *node)
 size_t
 select_movable_cut(const struct tc_node *node, size_t c)
 {
-    size_t i = 0;
-    size_t n = 0;
-    for (i = 0; i + 1 < node->nchildren; i++)
-        if (is_movable_cut(node, i))
-            if (n++ == c) return i;
-    return -1;
+    if (c >= node->nmovable) return -1;
+    return node->movable[c];
 }
@@ -6,6 +6,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "tc.h"
 
@@ -19,6 +20,15 @@
 #define IS_NOMINAL(node) \
     ((node)->tree->param_def[(node)->param].type == TC_NOMINAL)
 
+/* Number of categories of a nominal parameter. */
+#define NCATEGORIES(pd) ((size_t) ((pd)->max.int64 - (pd)->min.int64 + 1))
+
+/* Number of words of a bitset of `n` bits. */
+#define BITSET_WORDS(n) (((n) + 63)/64)
+#define BITSET_GET(set, i) (((set)[(i)/64] >> ((i)%64)) & 1)
+#define BITSET_SET(set, i) ((set)[(i)/64] |= (uint64_t) 1 << ((i)%64))
+#define BITSET_CLEAR(set, i) ((set)[(i)/64] &= ~((uint64_t) 1 << ((i)%64)))
+
 union tc_value min(union tc_valuep data, size_t N, enum tc_param_size size);
 
 union tc_value max(union tc_valuep data, size_t N, enum tc_param_size size);
@@ -29,16 +39,42 @@ void free_segment(struct tc_segment *segment);
 
 void *tree_alloc(struct tc_tree *tree, size_t size);
 
-void tree_attach_node(struct tc_node *node);
+struct tc_node *tree_alloc_node(struct tc_tree *tree);
+
+void tree_free_node(struct tc_node *node);
+
+int node_reserve(struct tc_node *node, size_t n);
+
+int init_catsets(struct tc_tree *tree);
+
+uint64_t *node_catset(const struct tc_node *node, size_t param);
+
+size_t bitset_count(const uint64_t *set, size_t n);
+
+size_t bitset_select(const uint64_t *set, size_t n, size_t r);
+
+int insert_cut(struct tc_node *node, size_t i, double cut);
+
+int remove_cut(struct tc_node *node, size_t i);
+
+int update_supersegment(struct tc_node *node);
+
+int tree_attach_node(struct tc_node *node);
 
 void tree_detach_node(struct tc_node *node);
 
+size_t tree_live_size(const struct tc_tree *tree);
+
 struct tc_node *copy_node(const struct tc_node *node, struct tc_tree *tree);
 
 int compact_tree(struct tc_tree *new, const struct tc_tree *old);
 
+int tree_compact(struct tc_tree **tree, size_t size);
+
 int init_segment(struct tc_segment *segment, size_t K);
 
+void update_boxes(struct tc_node *node);
+
 void
 node_range(
     const struct tc_node *node,
@@ -46,6 +82,24 @@ node_range(
     struct tc_range *range
 );
 
+double segment_volume(const struct tc_node *node);
+
+double
+range_volume(
+    const struct tc_node *node,
+    size_t param,
+    double min,
+    double max
+);
+
+double *new_log_factorial_table(size_t size);
+
+double log_factorial(const struct tc_tree *tree, size_t n);
+
+double segment_log_likelihood(const struct tc_tree *tree, size_t NX, double V);
+
+double log_likelihood_norm(const struct tc_tree *tree, size_t N, size_t S);
+
 size_t find_child(const struct tc_node *node, const struct tc_node *child);
 
 bool check_tree(const struct tc_tree *tree);
@@ -64,6 +118,26 @@ is_segment(const struct tc_node *node)
 
 size_t count_segments(const struct tc_tree *tree);
 
+bool has_stats(const struct tc_tree *tree, const void *ds[], size_t N);
+
+const uint32_t *
+tree_weights(const struct tc_tree *tree, const void *ds[], size_t N);
+
+void
+route_elements(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N,
+    size_t *NX
+);
+
+double
+routed_log_likelihood(
+    const struct tc_tree *tree,
+    const void *ds[],
+    size_t N
+);
+
 struct tc_node *select_segment(const struct tc_tree *tree, size_t s);
 
 bool is_supersegment(const struct tc_node *node);